@@ -0,0 +1,55 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+////////////////////////////////////////////////////////////////////////////////
+// Device database benchmark
+//
+// Times find_device() of acdcontrol for every model of the built-in table and
+// for as many devices it does not know, as --auto looks up both kinds. The
+// program itself is compiled in without its main(). The cold start of the
+// program is timed by 'make bench' as well.
+////////////////////////////////////////////////////////////////////////////////
+
+#define ACDCONTROL_NO_MAIN
+#include "acdcontrol.cpp"
+
+const unsigned LOOKUP_ROUNDS = 1000000;
+
+int main( int argc, char** argv ) {
+  unsigned rounds = argc > 1 ? strtoul( argv[ 1 ], 0, 10 ) : LOOKUP_ROUNDS;
+  vector< pair< Vendor, Product > > keys;
+
+  for ( size_t i = 0; i < DEVICE_COUNT; ++i ) {
+    keys.push_back( make_pair( supportedDevices[ i ].vendor,
+                               supportedDevices[ i ].product ));
+    keys.push_back( make_pair( supportedDevices[ i ].vendor,
+                               supportedDevices[ i ].product ^ 0x8000 ));
+  }
+
+  /* count the hits so the lookups cannot be optimized away */
+  size_t found = 0;
+  uint64_t start = now_ns();
+  for ( unsigned r = 0; r < rounds; ++r )
+    for ( size_t i = 0; i < keys.size(); ++i )
+      if ( find_device( keys[ i ].first, keys[ i ].second ))
+        ++found;
+  uint64_t elapsed = now_ns() - start;
+
+  printf( "find_device: %.1f ns per lookup (%zu of %zu known)\n",
+          (double)elapsed / rounds / keys.size(), found / rounds,
+          keys.size() );
+  return 0;
+}
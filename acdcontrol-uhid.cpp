@@ -0,0 +1,296 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+////////////////////////////////////////////////////////////////////////////////
+// Virtual Apple display
+//
+// Creates a HID device in the kernel through /dev/uhid which looks like an
+// Apple Cinema display to acdcontrol: Apple vendor and product, a monitor
+// application on usage page 0x80 and the brightness as usage 0x820010 in
+// feature report 16. GET_REPORT and SET_REPORT of the kernel are answered
+// here, so acdcontrol runs its unmodified code against a real device node.
+//
+// The kernel gives such a device a hidraw node. hiddev nodes are created by
+// the USB HID driver only, so they cannot be tested this way.
+//
+// Needs the uhid module and write access to /dev/uhid. Runs until SIGINT or
+// SIGTERM, which remove the device again.
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include <string>
+
+using namespace std;
+
+const int APPLE                           = 0x05ac;
+const int CINEMA_DISPLAY_30               = 0x9232;
+const int BRIGHTNESS_CONTROL              = 16;
+
+/** Display as given on the command line */
+struct Options {
+  int product;
+  int brightness_min;
+  int brightness_max;
+  int brightness;       // at start, -1 for the middle of the range
+  int latency_ms;       // before each report is answered
+
+  Options()
+    : product( CINEMA_DISPLAY_30 )
+    , brightness_min( 0 )
+    , brightness_max( 255 )
+    , brightness( -1 )
+    , latency_ms( 0 )
+    { }
+};
+
+volatile sig_atomic_t quit_requested = 0;
+
+void request_quit( int ) {
+  quit_requested = 1;
+}
+
+void help( const char* program ) {
+  printf( "USAGE: %s [--product <hex>] [--min <n>] [--max <n>] "
+          "[--brightness <n>] [--latency <ms>] [--help|-h]\n\n"
+          "Parameters:\n"
+          "  --product <hex>\n"
+          "         Product id of the Apple display, default 9232\n"
+          "         (Cinema HD Display 30\").\n"
+          "  --min <n>, --max <n>\n"
+          "         Brightness range the display describes, default 0 to 255.\n"
+          "  --brightness <n>\n"
+          "         Brightness at start, default the middle of the range.\n"
+          "  --latency <ms>\n"
+          "         Wait that long before answering a report, as over USB.\n"
+          "  --help,-h\n"
+          "         Show this help message and quit.\n", program );
+}
+
+/** Sends an event to the kernel
+ * @return false on failure, errno set */
+bool send_event( int fd, const uhid_event& ev ) {
+  return write( fd, &ev, sizeof( ev )) == sizeof( ev );
+}
+
+/** Creates the device
+ * @param uniq unique name the hidraw node is found by
+ */
+bool create_display( int fd, const Options& o, const string& uniq ) {
+  int lo = o.brightness_min;
+  int hi = o.brightness_max;
+  const unsigned char desc[] = {
+    0x05, 0x80, 0x09, 0x01, 0xA1, 0x01,         /* monitor application */
+    0x85, BRIGHTNESS_CONTROL,
+    0x05, 0x82, 0x09, 0x10,                     /* brightness */
+    0x16, (unsigned char)lo, (unsigned char)( lo >> 8 ),
+    0x26, (unsigned char)hi, (unsigned char)( hi >> 8 ),
+    0x75, 0x10, 0x95, 0x01, 0xB1, 0x02,         /* 16 bit variable */
+    0xC0
+  };
+
+  uhid_event ev;
+  memset( &ev, 0, sizeof( ev ));
+  ev.type = UHID_CREATE2;
+  snprintf( (char*)ev.u.create2.name, sizeof( ev.u.create2.name ),
+            "Apple Display (acdcontrol-uhid)" );
+  snprintf( (char*)ev.u.create2.uniq, sizeof( ev.u.create2.uniq ), "%s",
+            uniq.c_str() );
+  memcpy( ev.u.create2.rd_data, desc, sizeof( desc ));
+  ev.u.create2.rd_size = sizeof( desc );
+  ev.u.create2.bus = BUS_USB;
+  ev.u.create2.vendor = APPLE;
+  ev.u.create2.product = o.product;
+  return send_event( fd, ev );
+}
+
+/** @return hidraw node of the device with the unique name, empty if the
+ *          kernel has not created it (yet) */
+string find_hidraw( const string& uniq ) {
+  string node;
+  DIR* dir = opendir( "/sys/class/hidraw" );
+  if ( !dir )
+    return node;
+
+  string wanted = "HID_UNIQ=" + uniq + "\n";
+  while ( dirent* entry = readdir( dir )) {
+    string uevent = string( "/sys/class/hidraw/" ) + entry->d_name +
+      "/device/uevent";
+    FILE* f = fopen( uevent.c_str(), "r" );
+    if ( !f )
+      continue;
+    char line[ 256 ];
+    while ( node.empty() && fgets( line, sizeof( line ), f ))
+      if ( wanted == line )
+        node = string( "/dev/" ) + entry->d_name;
+    fclose( f );
+  }
+  closedir( dir );
+  return node;
+}
+
+/** Answers a GET_REPORT or SET_REPORT of the kernel
+ * @param report brightness report, the id followed by the 16 bit value
+ */
+bool answer( int fd, const uhid_event& request, unsigned char* report,
+             const Options& o ) {
+  uhid_event ev;
+  memset( &ev, 0, sizeof( ev ));
+  if ( o.latency_ms )
+    usleep( o.latency_ms * 1000 );
+
+  if ( request.type == UHID_GET_REPORT ) {
+    ev.type = UHID_GET_REPORT_REPLY;
+    ev.u.get_report_reply.id = request.u.get_report.id;
+    if ( request.u.get_report.rtype != UHID_FEATURE_REPORT ||
+         request.u.get_report.rnum != BRIGHTNESS_CONTROL )
+      ev.u.get_report_reply.err = EIO;
+    else {
+      ev.u.get_report_reply.size = 3;
+      memcpy( ev.u.get_report_reply.data, report, 3 );
+    }
+  } else {
+    ev.type = UHID_SET_REPORT_REPLY;
+    ev.u.set_report_reply.id = request.u.set_report.id;
+    if ( request.u.set_report.rtype != UHID_FEATURE_REPORT ||
+         request.u.set_report.rnum != BRIGHTNESS_CONTROL ||
+         request.u.set_report.size < 3 )
+      ev.u.set_report_reply.err = EIO;
+    else {
+      memcpy( report, request.u.set_report.data, 3 );
+      printf( "brightness %d\n", report[ 1 ] | report[ 2 ] << 8 );
+      fflush( stdout );
+    }
+  }
+  return send_event( fd, ev );
+}
+
+int main( int argc, char** argv ) {
+  Options o;
+
+  static struct option long_options[] = {
+    {"product", 1, 0, 'p'},
+    {"min", 1, 0, 'm'},
+    {"max", 1, 0, 'M'},
+    {"brightness", 1, 0, 'b'},
+    {"latency", 1, 0, 'l'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int c;
+  while (( c = getopt_long( argc, argv, "h", long_options, 0 )) != -1 ) {
+    switch ( c ) {
+    case 'p':
+      o.product = strtol( optarg, 0, 16 );
+      break;
+    case 'm':
+      o.brightness_min = atoi( optarg );
+      break;
+    case 'M':
+      o.brightness_max = atoi( optarg );
+      break;
+    case 'b':
+      o.brightness = atoi( optarg );
+      break;
+    case 'l':
+      o.latency_ms = atoi( optarg );
+      break;
+    default:
+      help( argv[ 0 ] );
+      exit( c == 'h' ? 0 : 1 );
+    }
+  }
+
+  int value = o.brightness >= 0 ? o.brightness :
+    ( o.brightness_min + o.brightness_max ) / 2;
+  unsigned char report[ 3 ] = {
+    BRIGHTNESS_CONTROL, (unsigned char)value, (unsigned char)( value >> 8 )
+  };
+
+  int fd = open( "/dev/uhid", O_RDWR | O_CLOEXEC );
+  if ( fd < 0 ) {
+    perror( "/dev/uhid" );
+    exit( 1 );
+  }
+
+  char uniq[ 64 ];
+  snprintf( uniq, sizeof( uniq ), "acdcontrol-uhid-%d", (int)getpid() );
+  if ( !create_display( fd, o, uniq )) {
+    perror( "Creating the device failed" );
+    exit( 1 );
+  }
+
+  /* let the signals interrupt read() */
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa ));
+  sa.sa_handler = request_quit;
+  sigaction( SIGINT, &sa, 0 );
+  sigaction( SIGTERM, &sa, 0 );
+
+  int rc = 0;
+  bool announced = false;
+  uhid_event ev;
+  while ( !quit_requested ) {
+    if ( read( fd, &ev, sizeof( ev )) < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror( "/dev/uhid" );
+      rc = 1;
+      break;
+    }
+
+    switch ( ev.type ) {
+    case UHID_START:
+      /* the node appears once the kernel connected the device */
+      for ( int i = 0; !announced && i < 100; ++i ) {
+        string node = find_hidraw( uniq );
+        if ( !node.empty() ) {
+          printf( "%s: %04x:%04x brightness %d\n", node.c_str(), APPLE,
+                  o.product, value );
+          fflush( stdout );
+          announced = true;
+        } else
+          usleep( 10000 );
+      }
+      break;
+    case UHID_GET_REPORT:
+    case UHID_SET_REPORT:
+      if ( !answer( fd, ev, report, o )) {
+        perror( "/dev/uhid" );
+        rc = 1;
+        quit_requested = 1;
+      }
+      break;
+    }
+  }
+
+  memset( &ev, 0, sizeof( ev ));
+  ev.type = UHID_DESTROY;
+  send_event( fd, ev );
+  close( fd );
+  return rc;
+}
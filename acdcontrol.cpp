@@ -17,25 +17,55 @@
 #define HID_MAX_APPLICATIONS		16
 
 #define VERSION "0.3"
+#define DEFAULT_SOCKET "/run/acdcontrol.sock"
+#define DEFAULT_DISCOVERY_CACHE "/run/acdcontrol/discovery"
+#define DEFAULT_DEVICE_DB "/etc/acdcontrol/devices.db"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <asm/types.h>
 #include <sys/signal.h>
 #include <getopt.h>
+#include <glob.h>
+#include <dirent.h>
 #include <linux/hiddev.h>
+#include <linux/hidraw.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
 #include <map>
-#include <set>
 #include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <random>
 
 using namespace std;
 
@@ -43,13 +73,38 @@ const int GET = 0;
 const int SET = 1;
 const int DETECT = 2;
 const int SETREL = 3;
+const int DAEMON = 4;
+const int WATCH = 5;
+const int DUMP = 6;
+const int SAVE = 7;
+const int RESTORE = 8;
+
+// How writes of relative changes are verified
+const int VERIFY_NONE = 0;
+const int VERIFY_SYNC = 1;
+const int VERIFY_ASYNC = 2;
+const char* const VERIFY_NAMES[] = { "none", "sync", "async" };
+
+// Kernel interfaces the display is accessed through
+const int BACKEND_HIDDEV = 0;             // usages of parsed reports
+const int BACKEND_HIDRAW = 1;             // raw reports
+const int BACKEND_USBFS = 2;              // control transfers to the device
+const int BACKEND_MOCK = 3;               // displays kept in memory
+const int BACKEND_REPLAY = 4;             // displays of a recorded trace
+const char* const BACKEND_NAMES[] = { "hiddev", "hidraw", "usbfs", "mock",
+                                      "replay" };
+
+const int USB_DEVICE_MAJOR = 189;         // of the usbfs nodes
+const unsigned USB_TIMEOUT_MS = 1000;     // of a control transfer
 
 // Supported vendors
 const int APPLE                           = 0x05ac;
 const int SAMSUNG                         = 0x0419;
 
+// Brightness control used if the device does not describe its reports
 const int BRIGHTNESS_CONTROL              = 16;
 const int USAGE_CODE                      = 0x820010;
+const unsigned MONITOR_APPLICATION        = 0x800001;
 
 const int STUDIO_DISPLAY_15               = 0x9215;
 const int STUDIO_DISPLAY_17               = 0x9217;
@@ -67,43 +122,166 @@ const int CINEMA_DISPLAY_HD_27_2013       = 0x9227;
 const int S1                              = 0x8002;
 
 // Forward Declarations
-void init_device_database();
-void dump_supported();
+void dump_supported( bool models );
 
 // Helpful declarations
 typedef unsigned Vendor;
 typedef unsigned Product;
 
+// Quirks of a model
+const unsigned QUIRK_PRIME_WRITE          = 1;  // read the report before the
+                                                // first write, or the other
+                                                // fields of it are zeroed
+const unsigned QUIRK_READBACK             = 2;  // display may not take the
+                                                // value as written
+const unsigned QUIRKS_ALL = QUIRK_PRIME_WRITE | QUIRK_READBACK;
+
+/* Both structs are records of the binary device database as well, so they
+ * hold no pointers */
 struct DeviceId {
-  Product product;
   Vendor vendor;
-  string description;
+  Product product;
+  char name[ 32 ];
+  char description[ 64 ];
   int brightness_min;
   int brightness_max;
+  unsigned quirks;
+  unsigned granularity;     // display takes multiples of it only, 0 for 1
+  unsigned settle_ms;       // time a write takes effect in
+  unsigned release;         // bcdDevice of the model, 0 for any; models
+                            // sharing a product id differ in it
+};
+
+struct VendorId {
+  Vendor vendor;
+  char name[ 32 ];
+};
 
-  DeviceId ( Vendor vendor_, Product product_, string description_,
-		 int brightness_min = 0, int brightness_max = 255 )
-    : product( product_ )
-    , vendor( vendor_ )
-    , description( description_ )
-	, brightness_min(brightness_min)
-	, brightness_max(brightness_max)
-	{ }
+/* The database is built by the compiler, nothing is constructed at startup */
+constexpr VendorId supportedVendors[] = {
+  { SAMSUNG, "Samsung Electronics" },
+  { APPLE,   "Apple" },
+};
 
-  bool operator < ( const DeviceId& other ) const {
-    return (vendor < other.vendor) || 
-      (vendor == other.vendor && product < other.product );
-  }
+/* Sorted by vendor and product, --list-all prints it in this order. The new
+ * 20" and 23" models share the product id of the old ones, they can be told
+ * apart by the release in the device database file only. Entries are
+ * quirks, granularity, settle time and release after the range. None of
+ * these models needs a workaround: the zero read after boot up came from
+ * taking the value before the report was fetched, which get_brightness()
+ * does first now. The device database file can add quirks to a model. */
+constexpr DeviceId supportedDevices[] = {
+  { SAMSUNG, S1, "S1", "Samsung SyncMaster 757NF", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, STUDIO_DISPLAY_15, "STUDIO_DISPLAY_15",
+    "Apple Studio Display 15\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, STUDIO_DISPLAY_17, "STUDIO_DISPLAY_17",
+    "Apple Studio Display 17\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_23_OLD, "CINEMA_DISPLAY_23_OLD",
+    "Apple Cinema Display 23\" (old)", 0, 255,
+    0, 0, 0, 0 },
+//  { APPLE, CINEMA_DISPLAY_23_NEW, "CINEMA_DISPLAY_23_NEW",
+//    "Apple Cinema Display 23\" (new)", 0, 255,
+//    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_20_OLD, "CINEMA_DISPLAY_20_OLD",
+    "Apple Cinema Display 20\" (old)", 0, 255,
+    0, 0, 0, 0 },
+//  { APPLE, CINEMA_DISPLAY_20_NEW, "CINEMA_DISPLAY_20_NEW",
+//    "Apple Cinema Display 20\" (new)", 0, 255,
+//    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_24, "CINEMA_DISPLAY_24",
+    "Apple Cinema Display 24\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_HD_27, "CINEMA_DISPLAY_HD_27",
+    "Apple Cinema HD Display 27\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_27, "CINEMA_DISPLAY_27",
+    "Apple Cinema HD Display 27\"", 0, 1024,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_HD_27_2013, "CINEMA_DISPLAY_HD_27_2013",
+    "Apple Cinema HD Display 27\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_30, "CINEMA_DISPLAY_30",
+    "Apple Cinema HD Display 30\"", 0, 255,
+    0, 0, 0, 0 },
+  { APPLE, CINEMA_DISPLAY_LED_24, "CINEMA_DISPLAY_LED_24",
+    "Apple LED Cinema Display 24\"", 0, 255,
+    0, 0, 0, 0 },
 };
 
-typedef set< DeviceId > SupportedDevices;
-SupportedDevices supportedDevices;
+const size_t DEVICE_COUNT = sizeof( supportedDevices ) /
+                            sizeof( *supportedDevices );
+
+/* Devices are found through a perfect hash: a multiplier is searched at
+ * compile time which maps every (vendor, product) of the database to a slot
+ * of its own, so a lookup is a multiplication and a single comparison. */
+const unsigned DEVICE_SLOT_BITS = 5;
+const size_t DEVICE_SLOTS = 1 << DEVICE_SLOT_BITS;
+static_assert( DEVICE_COUNT <= DEVICE_SLOTS / 2,
+               "device database too large for the hash table" );
+
+constexpr uint32_t device_key( Vendor vendor, Product product ) {
+  return (uint32_t)( vendor & 0xFFFF ) << 16 | ( product & 0xFFFF );
+}
+
+constexpr unsigned device_slot( uint32_t key, uint32_t seed ) {
+  return (uint32_t)( key * seed ) >> ( 32 - DEVICE_SLOT_BITS );
+}
+
+/** @return whether seed maps no two devices to the same slot */
+constexpr bool perfect_seed( uint32_t seed ) {
+  bool used[ DEVICE_SLOTS ] = {};
+  for ( size_t i = 0; i < DEVICE_COUNT; ++i ) {
+    unsigned slot = device_slot( device_key( supportedDevices[ i ].vendor,
+                                             supportedDevices[ i ].product ),
+                                 seed );
+    if ( used[ slot ] )
+      return false;
+    used[ slot ] = true;
+  }
+  return true;
+}
+
+constexpr uint32_t find_seed() {
+  uint32_t seed = 0x9e3779b1;
+  while ( !perfect_seed( seed ))
+    seed += 2;
+  return seed;
+}
+
+constexpr uint32_t DEVICE_SEED = find_seed();
+
+/** @return whether the devices are sorted, see dump_supported() */
+constexpr bool devices_sorted() {
+  for ( size_t i = 1; i < DEVICE_COUNT; ++i )
+    if ( device_key( supportedDevices[ i - 1 ].vendor,
+                     supportedDevices[ i - 1 ].product ) >=
+         device_key( supportedDevices[ i ].vendor,
+                     supportedDevices[ i ].product ))
+      return false;
+  return true;
+}
+static_assert( devices_sorted(), "supportedDevices must be sorted" );
 
-typedef map< Vendor, string > SupportedVendors;
-SupportedVendors supportedVendors;
+/** Hash table: index into supportedDevices per slot, -1 if empty */
+struct DeviceSlots {
+  signed char index[ DEVICE_SLOTS ];
+};
 
-typedef pair< Vendor, string> VendorDesc;
+constexpr DeviceSlots make_device_slots() {
+  DeviceSlots slots = {};
+  for ( size_t s = 0; s < DEVICE_SLOTS; ++s )
+    slots.index[ s ] = -1;
+  for ( size_t i = 0; i < DEVICE_COUNT; ++i )
+    slots.index[ device_slot( device_key( supportedDevices[ i ].vendor,
+                                          supportedDevices[ i ].product ),
+                              DEVICE_SEED ) ] = i;
+  return slots;
+}
 
+constexpr DeviceSlots deviceSlots = make_device_slots();
 
 /** @return whether the string *seems* to be a number */
 bool number( const char* str ){
@@ -112,184 +290,4624 @@ bool number( const char* str ){
   return ((*str >= '0') && (*str <= '9')) || (*str == '+') || (*str == '-');
 }
 
-/** @return a non-NULL DeviceID ptr if the device is in our database */
-const DeviceId* is_supported ( const hiddev_devinfo& device_info ) {
-  Product product = device_info.product & 0xFFFF;
-  Vendor vendor = device_info.vendor & 0xFFFF;
+////////////////////////////////////////////////////////////////////////////////
+// Device database file
+//
+// Displays not known at compile time, or known ones with different ranges and
+// quirks, are described in a text file:
+//
+//   vendor <vendor> <name>
+//   device <vendor> <product>[/<release>] <model> <min> <max> <quirks>
+//          <description>
+//
+// Vendor, product and release are hexadecimal. Quirks is "-" or a comma
+// separated list of needs-prime-write, readback-required,
+// coarse-granularity=<n> and settle-delay-ms=<ms>. The tool
+// compiles the text into a binary file of sorted DeviceId and VendorId records
+// in host byte order, which is mapped at startup and searched in place.
+// Entries of the file take precedence over the built-in ones.
+////////////////////////////////////////////////////////////////////////////////
+
+const char DEVICE_DB_MAGIC[ 8 ] = { 'A', 'C', 'D', 'D', 'B', '2', 0, 0 };
+
+struct DeviceDbHeader {
+  char magic[ 8 ];
+  uint32_t vendor_count;
+  uint32_t device_count;
+  /* followed by vendor_count VendorId and device_count DeviceId records */
+};
+
+const VendorId* db_vendors = 0;
+size_t db_vendor_count = 0;
+const DeviceId* db_devices = 0;
+size_t db_device_count = 0;
+
+bool device_order( const DeviceId& a, const DeviceId& b ) {
+  uint32_t ka = device_key( a.vendor, a.product );
+  uint32_t kb = device_key( b.vendor, b.product );
+  return ka < kb || ( ka == kb && a.release < b.release );
+}
+
+/** @return whether the text field is terminated within its size */
+bool terminated( const char* field, size_t size ) {
+  return memchr( field, 0, size ) != 0;
+}
+
+/** Checks the records of a mapped device database: the lookup relies on the
+ * devices being sorted and the names on being terminated
+ * @return false if the file is damaged or was not written by --compile-db
+ */
+bool valid_device_db( const VendorId* vendors, size_t vendor_count,
+                      const DeviceId* devices, size_t device_count ) {
+  for ( size_t i = 0; i < vendor_count; ++i )
+    if ( !terminated( vendors[ i ].name, sizeof( vendors[ i ].name )))
+      return false;
+  for ( size_t i = 0; i < device_count; ++i ) {
+    if ( !terminated( devices[ i ].name, sizeof( devices[ i ].name )) ||
+         !terminated( devices[ i ].description,
+                      sizeof( devices[ i ].description )) ||
+         ( i > 0 && !device_order( devices[ i - 1 ], devices[ i ] )))
+      return false;
+  }
+  return true;
+}
+
+/** Maps the binary device database
+ * @param path database file, missing files are no error
+ * @return false if the file exists but is not a device database
+ */
+bool load_device_db( const char* path ) {
+  if ( !*path )
+    return true;
+
+  int fd = open( path, O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 )
+    return errno == ENOENT;
+
+  struct stat st;
+  void* map = MAP_FAILED;
+  if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( DeviceDbHeader ))
+    map = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED )
+    return false;
+
+  const DeviceDbHeader* header = (const DeviceDbHeader*)map;
+  const VendorId* vendors = (const VendorId*)( header + 1 );
+  const DeviceId* devices =
+    (const DeviceId*)( vendors + header->vendor_count );
+  if ( memcmp( header->magic, DEVICE_DB_MAGIC, sizeof( DEVICE_DB_MAGIC )) ||
+       (uint64_t)st.st_size != sizeof( DeviceDbHeader ) +
+       header->vendor_count * (uint64_t)sizeof( VendorId ) +
+       header->device_count * (uint64_t)sizeof( DeviceId ) ||
+       !valid_device_db( vendors, header->vendor_count, devices,
+                         header->device_count )) {
+    munmap( map, st.st_size );
+    return false;
+  }
+
+  db_vendors = vendors;
+  db_vendor_count = header->vendor_count;
+  db_devices = devices;
+  db_device_count = header->device_count;
+  return true;
+}
+
+/** @return the device in the database file, NULL if it is not there. An
+ *          entry for the release wins over one for any release. */
+const DeviceId* find_db_device( Vendor vendor, Product product,
+                                unsigned release ) {
+  uint32_t key = device_key( vendor, product );
+  size_t lo = 0, hi = db_device_count;
+
+  /* first entry of the device */
+  while ( lo < hi ) {
+    size_t mid = ( lo + hi ) / 2;
+    if ( device_key( db_devices[ mid ].vendor,
+                     db_devices[ mid ].product ) < key )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  const DeviceId* any = 0;
+  for ( ; lo < db_device_count && device_key( db_devices[ lo ].vendor,
+                                              db_devices[ lo ].product ) == key;
+        ++lo ) {
+    if ( db_devices[ lo ].release == release )
+      return &db_devices[ lo ];
+    if ( db_devices[ lo ].release == 0 )
+      any = &db_devices[ lo ];
+  }
+  return any;
+}
+
+/** Copies a string into a fixed size record field
+ * @return false if the string does not fit
+ */
+bool copy_field( char* field, size_t size, const string& value ) {
+  if ( value.size() >= size )
+    return false;
+  memset( field, 0, size );
+  memcpy( field, value.data(), value.size() );
+  return true;
+}
+
+/** Parses the quirks column of the text database
+ * @return false if a quirk is unknown
+ */
+bool parse_quirks( const string& text, DeviceId& d ) {
+  d.quirks = 0;
+  d.granularity = 0;
+  d.settle_ms = 0;
+  if ( text == "-" )
+    return true;
+
+  istringstream in( text );
+  string quirk;
+  while ( getline( in, quirk, ',' )) {
+    if ( quirk == "needs-prime-write" )
+      d.quirks |= QUIRK_PRIME_WRITE;
+    else if ( quirk == "readback-required" )
+      d.quirks |= QUIRK_READBACK;
+    else if ( sscanf( quirk.c_str(), "coarse-granularity=%u",
+                      &d.granularity ) != 1 &&
+              sscanf( quirk.c_str(), "settle-delay-ms=%u",
+                      &d.settle_ms ) != 1 )
+      return false;
+  }
+  return true;
+}
+
+bool vendor_order( const VendorId& a, const VendorId& b ) {
+  return a.vendor < b.vendor;
+}
+
+/** Compiles the text device database into the binary one
+ * @param source text database
+ * @param target binary database, replaced atomically
+ * @return exit code
+ */
+int compile_device_db( const char* source, const char* target ) {
+  ifstream in( source );
+  if ( !in ) {
+    perror( source );
+    return 1;
+  }
+
+  vector< VendorId > vendors;
+  vector< DeviceId > devices;
+  string line;
+  int line_number = 0;
+
+  while ( getline( in, line )) {
+    ++line_number;
+    istringstream words( line );
+    string kind, name, description;
+    bool ok = true;
+
+    if ( !( words >> kind ) || kind[ 0 ] == '#' )
+      continue;
+
+    if ( kind == "vendor" ) {
+      VendorId v;
+      ok = (bool)( words >> hex >> v.vendor ) && getline( words >> ws, name ) &&
+        copy_field( v.name, sizeof( v.name ), name );
+      vendors.push_back( v );
+    } else if ( kind == "device" ) {
+      DeviceId d;
+      string product, quirks;
+      d.release = 0;
+      ok = (bool)( words >> hex >> d.vendor >> product >> name >> dec >>
+                   d.brightness_min >> d.brightness_max >> quirks ) &&
+        getline( words >> ws, description ) &&
+        sscanf( product.c_str(), "%x/%x", &d.product, &d.release ) >= 1 &&
+        parse_quirks( quirks, d ) &&
+        copy_field( d.name, sizeof( d.name ), name ) &&
+        copy_field( d.description, sizeof( d.description ), description );
+      devices.push_back( d );
+    } else {
+      ok = false;
+    }
+
+    if ( !ok ) {
+      cerr << source << ":" << line_number << ": malformed entry" << endl;
+      return 1;
+    }
+  }
+
+  sort( vendors.begin(), vendors.end(), vendor_order );
+  stable_sort( devices.begin(), devices.end(), device_order );
+  for ( size_t i = 1; i < devices.size(); ++i ) {
+    if ( !device_order( devices[ i - 1 ], devices[ i ] )) {
+      cerr << source << ": " << devices[ i ].name << " listed twice" << endl;
+      return 1;
+    }
+  }
+
+  DeviceDbHeader header;
+  memcpy( header.magic, DEVICE_DB_MAGIC, sizeof( header.magic ));
+  header.vendor_count = vendors.size();
+  header.device_count = devices.size();
+
+  string tmp = string( target ) + ".tmp";
+  FILE* f = fopen( tmp.c_str(), "w" );
+  if ( !f ) {
+    perror( tmp.c_str() );
+    return 1;
+  }
+  bool written =
+    fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+    fwrite( vendors.data(), sizeof( VendorId ), vendors.size(), f ) ==
+    vendors.size() &&
+    fwrite( devices.data(), sizeof( DeviceId ), devices.size(), f ) ==
+    devices.size();
+  if ( fclose( f ) != 0 || !written || rename( tmp.c_str(), target ) != 0 ) {
+    perror( target );
+    unlink( tmp.c_str() );
+    return 1;
+  }
+  return 0;
+}
+
+/** @param release bcdDevice of the device, 0 if unknown
+ * @return a non-NULL DeviceID ptr if the device is in our database */
+const DeviceId* find_device ( Vendor vendor, Product product,
+                              unsigned release = 0 ) {
+  const DeviceId* device = find_db_device( vendor, product, release );
+  if ( device )
+    return device;
+
+  int i = deviceSlots.index[ device_slot( device_key( vendor, product ),
+                                          DEVICE_SEED ) ];
+  if ( i >= 0 && supportedDevices[ i ].vendor == ( vendor & 0xFFFF ) &&
+       supportedDevices[ i ].product == ( product & 0xFFFF ))
+    return &supportedDevices[ i ];
+  return 0;
+}
+
+/** @param name model name as --list-all --verbose shows it
+ * @return the model, NULL if it is not in the database
+ */
+const DeviceId* find_model( const string& name ) {
+  for ( size_t i = 0; i < db_device_count; ++i )
+    if ( name == db_devices[ i ].name )
+      return &db_devices[ i ];
+  for ( size_t i = 0; i < DEVICE_COUNT; ++i )
+    if ( name == supportedDevices[ i ].name )
+      return &supportedDevices[ i ];
+  return 0;
+}
+
+/** @return a non-NULL DeviceID ptr if the device is in our database */
+const DeviceId* is_supported ( const hiddev_devinfo& device_info ) {
+  return find_device( device_info.vendor & 0xFFFF,
+                      device_info.product & 0xFFFF,
+                      device_info.version & 0xFFFF );
+}
+
+/**
+ * @param v query vendor
+ * @param p query product
+ * @return description of the device with given vendor and product 
+ */
+const char* description ( Vendor v, Product p ) {
+  const DeviceId* device = find_device( v, p );
+  return device ? device->description : "";
+}
+
+/** @param v vendor to query
+ * @return name of the vendor, NULL if the vendor is not in the database
+ */
+const char* vendor_name ( Vendor v ) {
+  v &= 0xFFFF;
+  for ( size_t i = 0; i < db_vendor_count; ++i )
+    if ( db_vendors[ i ].vendor == v )
+      return db_vendors[ i ].name;
+  for ( size_t i = 0; i < sizeof( supportedVendors ) /
+          sizeof( *supportedVendors ); ++i )
+    if ( supportedVendors[ i ].vendor == v )
+      return supportedVendors[ i ].name;
+  return 0;
+}
+
+/** @param v vendor to query
+ * @return true if the venodr is in the database 
+ */
+bool known_vendor ( Vendor v ) {
+  return vendor_name( v ) != 0;
+}
+
+/** Pretty-prints the given device information
+ * @param o output stream to print to
+ * @param device_info HID device info
+ */
+void format_device( ostream& o, const hiddev_devinfo& device_info ) {
+  Vendor  v = device_info.vendor & 0xFFFF;
+  Product p = device_info.product & 0xFFFF;
+  o << "Vendor=" << showbase << setw( 6 ) << hex << v;
+  if ( known_vendor( v ) )
+    o << " (" << vendor_name( v ) << ")";
+  
+  o << ", Product=" << showbase << setw( 6 ) << hex << p ;
+
+  if ( is_supported( device_info )) 
+    o << "[" << description( v, p ) << "]";
+
+  o << endl;
+}
+
+/** Location of the brightness control in the reports of a device */
+struct Layout {
+  unsigned report_type;
+  unsigned report_id;
+  unsigned field_index;
+  unsigned usage_index;
+  unsigned usage_code;
+  int logical_minimum;      // range of the value
+  int logical_maximum;
+};
+
+typedef map< unsigned, Layout > UsageMap;   // by usage code
+
+/** Report field with the codes of its usages */
+struct Field {
+  unsigned report_type;
+  unsigned report_id;
+  unsigned field_index;
+  unsigned report_count;       // values the field holds
+  vector< unsigned > codes;    // by usage index
+};
+
+typedef vector< Field > Fields;     // grouped by report
+
+/** Report types in the order their usages are preferred in */
+const unsigned REPORT_TYPES[] = { HID_REPORT_TYPE_FEATURE,
+                                  HID_REPORT_TYPE_OUTPUT,
+                                  HID_REPORT_TYPE_INPUT };
+
+/** @return name of the HID report type */
+const char* report_type_name( unsigned type ) {
+  switch ( type ) {
+  case HID_REPORT_TYPE_INPUT:   return "Input";
+  case HID_REPORT_TYPE_OUTPUT:  return "Output";
+  case HID_REPORT_TYPE_FEATURE: return "Feature";
+  }
+  return "Unknown";
+}
+
+/** @return monotonic time in nanoseconds */
+uint64_t now_ns() {
+  timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Backends
+//
+// A display is driven through the kernel interface its node belongs to, and
+// all of them are presented the way hiddev works: reports are fetched from and
+// sent to the device as a whole, usages are read and written in a copy of the
+// reports in between. hiddev keeps that copy in the kernel. hidraw and usbfs
+// move raw reports, so the copy is kept here and the fields are located by
+// parsing the report descriptor. The mock keeps a display in memory, so the
+// program can be run without one, and simulates the delays, faults and quirks
+// of real displays on request. Any backend can be recorded into a trace, which
+// the replay backend serves back.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Device operations of an opened display. As the hiddev ioctls they are
+ * modelled on, they return -1 with errno set on failure. */
+struct Backend {
+  virtual ~Backend() { }
+
+  /** @return version of the driver, 0 if there is none to tell */
+  virtual int version() { return 0; }
+  virtual int devinfo( hiddev_devinfo& info ) = 0;
+  /** @return usage of the application collection with the index */
+  virtual int application( unsigned index ) = 0;
+  virtual int init_report() { return 0; }
+
+  /* description of the reports */
+  virtual int report_info( hiddev_report_info& info ) = 0;
+  virtual int field_info( hiddev_field_info& info ) = 0;
+  virtual int usage_code( hiddev_usage_ref& ref ) = 0;
+
+  /* usages in the copy of the reports, and the reports themselves */
+  virtual int get_usage( hiddev_usage_ref& ref ) = 0;
+  virtual int set_usage( const hiddev_usage_ref& ref ) = 0;
+  virtual int get_report( const hiddev_report_info& info ) = 0;
+  virtual int set_report( const hiddev_report_info& info ) = 0;
+
+  /** Reads consecutive usages of a field at once */
+  virtual int get_usages( hiddev_usage_ref_multi& multi ) {
+    hiddev_usage_ref ref = multi.uref;
+    for ( unsigned i = 0; i < multi.num_values; ++i ) {
+      ref.usage_index = multi.uref.usage_index + i;
+      if ( get_usage( ref ) < 0 )
+        return -1;
+      multi.values[ i ] = ref.value;
+    }
+    return 0;
+  }
+
+  /** Writes consecutive usages of a field at once */
+  virtual int set_usages( const hiddev_usage_ref_multi& multi ) {
+    hiddev_usage_ref ref = multi.uref;
+    for ( unsigned i = 0; i < multi.num_values; ++i ) {
+      ref.usage_index = multi.uref.usage_index + i;
+      ref.value = multi.values[ i ];
+      if ( set_usage( ref ) < 0 )
+        return -1;
+    }
+    return 0;
+  }
+
+  /** Makes the device node report usage changes as hiddev_usage_ref
+   * records to read() */
+  virtual int enable_events() {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  /** @return serial number of the device, empty if unknown */
+  virtual string serial() { return ""; }
+};
+
+/** The hiddev driver, every operation is its ioctl */
+struct HiddevBackend : Backend {
+  int fd;
+
+  HiddevBackend( int fd_ ) : fd( fd_ ) { }
+
+  int version() {
+    int version = 0;
+    ioctl( fd, HIDIOCGVERSION, &version );
+    return version;
+  }
+  int devinfo( hiddev_devinfo& info ) {
+    return ioctl( fd, HIDIOCGDEVINFO, &info );
+  }
+  int application( unsigned index ) {
+    return ioctl( fd, HIDIOCAPPLICATION, index );
+  }
+  int init_report() { return ioctl( fd, HIDIOCINITREPORT, 0 ); }
+  int report_info( hiddev_report_info& info ) {
+    return ioctl( fd, HIDIOCGREPORTINFO, &info );
+  }
+  int field_info( hiddev_field_info& info ) {
+    return ioctl( fd, HIDIOCGFIELDINFO, &info );
+  }
+  int usage_code( hiddev_usage_ref& ref ) {
+    return ioctl( fd, HIDIOCGUCODE, &ref );
+  }
+  int get_usage( hiddev_usage_ref& ref ) {
+    return ioctl( fd, HIDIOCGUSAGE, &ref );
+  }
+  int set_usage( const hiddev_usage_ref& ref ) {
+    return ioctl( fd, HIDIOCSUSAGE, &ref );
+  }
+  int get_report( const hiddev_report_info& info ) {
+    return ioctl( fd, HIDIOCGREPORT, &info );
+  }
+  int set_report( const hiddev_report_info& info ) {
+    return ioctl( fd, HIDIOCSREPORT, &info );
+  }
+  int get_usages( hiddev_usage_ref_multi& multi ) {
+    return ioctl( fd, HIDIOCGUSAGES, &multi );
+  }
+  int set_usages( const hiddev_usage_ref_multi& multi ) {
+    return ioctl( fd, HIDIOCSUSAGES, &multi );
+  }
+  int enable_events() {
+    int flags = HIDDEV_FLAG_UREF | HIDDEV_FLAG_REPORT;
+    return ioctl( fd, HIDIOCSFLAG, &flags );
+  }
+
+  /** Most devices report their serial number as string descriptor 3 */
+  string serial() {
+    hiddev_string_descriptor serial;
+    memset( &serial, 0, sizeof( serial ));
+    serial.index = 3;
+    return ioctl( fd, HIDIOCGSTRING, &serial ) > 0 ? serial.value : "";
+  }
+};
+
+/** Field of a raw report, numbered as hiddev numbers it */
+struct RawField {
+  unsigned application;
+  unsigned flags;           // of the main item
+  unsigned bit_offset;      // from the byte after the report id
+  unsigned bit_size;        // of each value
+  unsigned count;           // values in the report
+  int logical_minimum;
+  int logical_maximum;
+  vector< unsigned > codes;   // by usage index
+};
+
+/** Raw report with its fields */
+struct RawReport {
+  unsigned bits;            // size without the report id
+  vector< RawField > fields;
+};
+
+/** What the report descriptor of a device tells */
+struct ReportDescriptor {
+  vector< unsigned > applications;    // usages of application collections
+  map< unsigned, RawReport > reports; // by type << 8 | id, the id is 0 if
+                                      // the device does not number them
+};
+
+/** @return data of a short item, sign extended if asked */
+int item_data( const unsigned char* data, unsigned size, bool sign ) {
+  unsigned value = 0;
+  for ( unsigned i = 0; i < size; ++i )
+    value |= data[ i ] << ( 8 * i );
+  if ( sign && size > 0 && size < 4 && ( data[ size - 1 ] & 0x80 ))
+    value |= ~0u << ( 8 * size );
+  return value;
+}
+
+/** Parses a HID report descriptor. Fields are made as the kernel makes them,
+ * so they are numbered alike: every main item with usages is a field, the
+ * others are padding.
+ * @param desc descriptor as the device reports it
+ * @param rd receives applications and reports
+ * @return false if the descriptor is truncated
+ */
+bool parse_report_descriptor( const unsigned char* desc, size_t size,
+                              ReportDescriptor& rd ) {
+  /* global items, saved and restored by push and pop */
+  struct Globals {
+    unsigned usage_page;
+    int logical_minimum;
+    int logical_maximum;
+    unsigned report_size;
+    unsigned report_id;
+    unsigned report_count;
+  } g = { 0, 0, 0, 0, 0, 0 };
+  vector< Globals > stack;
+  vector< unsigned > usages;          // local usages of the next main item
+  unsigned usage_minimum = 0;
+  vector< unsigned > collections;     // open collections, application usage
+                                      // or 0 for other kinds
+
+  for ( size_t i = 0; i < size; ) {
+    /* long items are reserved, nothing we know of uses them */
+    if ( desc[ i ] == 0xFE ) {
+      i += i + 1 < size ? 3 + desc[ i + 1 ] : size;
+      continue;
+    }
+
+    unsigned length = desc[ i ] & 3;
+    unsigned type = ( desc[ i ] >> 2 ) & 3;
+    unsigned tag = desc[ i ] >> 4;
+    if ( length == 3 )
+      length = 4;
+    if ( i + 1 + length > size )
+      return false;
+
+    const unsigned char* data = desc + i + 1;
+    unsigned value = item_data( data, length, false );
+    i += 1 + length;
+
+    if ( type == 1 ) {                              /* global */
+      switch ( tag ) {
+      case 0: g.usage_page = value; break;
+      case 1: g.logical_minimum = item_data( data, length, true ); break;
+      case 2: g.logical_maximum = item_data( data, length,
+                                             g.logical_minimum < 0 ); break;
+      case 7: g.report_size = value; break;
+      case 8: g.report_id = value; break;
+      case 9: g.report_count = value; break;
+      case 10: stack.push_back( g ); break;
+      case 11:
+        if ( !stack.empty() ) {
+          g = stack.back();
+          stack.pop_back();
+        }
+        break;
+      }
+    } else if ( type == 2 ) {                       /* local */
+      /* a four byte usage carries its own page */
+      unsigned usage = length == 4 ? value : g.usage_page << 16 | value;
+      if ( tag == 0 )
+        usages.push_back( usage );
+      else if ( tag == 1 )
+        usage_minimum = usage;
+      else if ( tag == 2 )
+        for ( unsigned u = usage_minimum; u <= usage &&
+                usages.size() < HID_MAX_USAGES; ++u )
+          usages.push_back( u );
+    } else if ( type == 0 ) {                       /* main */
+      unsigned report_type = tag == 8 ? HID_REPORT_TYPE_INPUT :
+        tag == 9 ? HID_REPORT_TYPE_OUTPUT :
+        tag == 11 ? HID_REPORT_TYPE_FEATURE : 0;
+
+      if ( tag == 10 ) {
+        bool application = value == 1 && !usages.empty();
+        collections.push_back( application ? usages[ 0 ] : 0 );
+        if ( application )
+          rd.applications.push_back( usages[ 0 ] );
+      } else if ( tag == 12 && !collections.empty() ) {
+        collections.pop_back();
+      }
+
+      if ( report_type ) {
+        RawReport& report = rd.reports[ report_type << 8 | g.report_id ];
+        if ( !usages.empty() ) {
+          RawField f = { 0, value, report.bits, g.report_size,
+                         g.report_count, g.logical_minimum,
+                         g.logical_maximum, vector< unsigned >() };
+          for ( size_t c = collections.size(); c-- > 0 && !f.application; )
+            f.application = collections[ c ];
+          for ( size_t u = 0; u < max( (size_t)g.report_count,
+                                       usages.size() ); ++u )
+            f.codes.push_back( usages[ min( u, usages.size() - 1 ) ] );
+          report.fields.push_back( f );
+        }
+        report.bits += g.report_size * g.report_count;
+      }
+      usages.clear();
+    }
+  }
+  return true;
+}
+
+/** @return value with the index of the field in the raw report */
+int raw_value( const vector< unsigned char >& report, const RawField& f,
+               unsigned index ) {
+  unsigned value = 0;
+  for ( unsigned b = 0; b < f.bit_size && b < 32; ++b ) {
+    unsigned bit = 8 + f.bit_offset + index * f.bit_size + b;
+    if ( bit / 8 < report.size() && ( report[ bit / 8 ] >> ( bit % 8 )) & 1 )
+      value |= 1u << b;
+  }
+  if ( f.logical_minimum < 0 && f.bit_size > 0 && f.bit_size < 32 &&
+       ( value >> ( f.bit_size - 1 )) & 1 )
+    value |= ~0u << f.bit_size;
+  return value;
+}
+
+/** Stores the value with the index of the field in the raw report */
+void set_raw_value( vector< unsigned char >& report, const RawField& f,
+                    unsigned index, int value ) {
+  for ( unsigned b = 0; b < f.bit_size && b < 32; ++b ) {
+    unsigned bit = 8 + f.bit_offset + index * f.bit_size + b;
+    if ( bit / 8 >= report.size() )
+      break;
+    if (( (unsigned)value >> b ) & 1 )
+      report[ bit / 8 ] |= 1 << ( bit % 8 );
+    else
+      report[ bit / 8 ] &= ~( 1 << ( bit % 8 ));
+  }
+}
+
+/** Backend moving raw reports, which keeps the copy of the reports hiddev
+ * keeps in the kernel */
+struct RawBackend : Backend {
+  hiddev_devinfo info;
+  ReportDescriptor descriptor;
+  map< unsigned, vector< unsigned char > > copies;  // id first, by key
+
+  RawBackend() { memset( &info, 0, sizeof( info )); }
+
+  /** Moves a report from or to the device
+   * @param report id byte followed by the report
+   * @param get read the report rather than write it
+   */
+  virtual int transfer( unsigned type, vector< unsigned char >& report,
+                        bool get ) = 0;
+
+  /** Takes the fields from the report descriptor
+   * @param size 0 if the device gave no report descriptor
+   */
+  void describe( const unsigned char* desc, size_t size ) {
+    if ( !parse_report_descriptor( desc, size, descriptor ) ||
+         !brightness_described() )
+      assume_brightness_report();
+    info.num_applications = descriptor.applications.size();
+  }
+
+  /** @return whether the report descriptor has the brightness control */
+  bool brightness_described() const {
+    map< unsigned, RawReport >::const_iterator it =
+      descriptor.reports.lower_bound( HID_REPORT_TYPE_FEATURE << 8 );
+    for ( ; it != descriptor.reports.end() &&
+            it->first >> 8 == HID_REPORT_TYPE_FEATURE; ++it )
+      for ( size_t i = 0; i < it->second.fields.size(); ++i )
+        if ( count( it->second.fields[ i ].codes.begin(),
+                    it->second.fields[ i ].codes.end(), USAGE_CODE ))
+          return true;
+    return false;
+  }
+
+  /** Describes the brightness report of the displays in our database for a
+   * device whose report descriptor is unreadable or lacks it: a 16 bit value
+   * after report id BRIGHTNESS_CONTROL, the range taken from the database */
+  void assume_brightness_report() {
+    const DeviceId* device = find_device( info.vendor, info.product );
+    if ( !device )
+      return;
+
+    RawReport& report =
+      descriptor.reports[ HID_REPORT_TYPE_FEATURE << 8 | BRIGHTNESS_CONTROL ];
+    RawField f = { MONITOR_APPLICATION, 0x02, report.bits, 16, 1,
+                   device->brightness_min, device->brightness_max,
+                   vector< unsigned >( 1, USAGE_CODE ) };
+    report.fields.push_back( f );
+    report.bits += 16;
+    if ( !count( descriptor.applications.begin(),
+                 descriptor.applications.end(), MONITOR_APPLICATION ))
+      descriptor.applications.push_back( MONITOR_APPLICATION );
+  }
+
+  /** @return the report, NULL with errno set if there is none */
+  const RawReport* find_report( unsigned type, unsigned id ) {
+    map< unsigned, RawReport >::const_iterator it =
+      descriptor.reports.find( type << 8 | id );
+    if ( it != descriptor.reports.end() && id <= HID_REPORT_ID_MASK )
+      return &it->second;
+    errno = EINVAL;
+    return 0;
+  }
+
+  /** @return the field, NULL with errno set if there is none */
+  const RawField* find_field( unsigned type, unsigned id, unsigned index ) {
+    const RawReport* report = find_report( type, id );
+    if ( report && index < report->fields.size() )
+      return &report->fields[ index ];
+    errno = EINVAL;
+    return 0;
+  }
+
+  /** @return copy of the report, zeroed until it is transferred */
+  vector< unsigned char >& copy_of( unsigned type, unsigned id ) {
+    vector< unsigned char >& copy = copies[ type << 8 | id ];
+    if ( copy.empty() ) {
+      copy.assign( 1 + ( find_report( type, id )->bits + 7 ) / 8, 0 );
+      copy[ 0 ] = id;
+    }
+    return copy;
+  }
+
+  int devinfo( hiddev_devinfo& info ) {
+    info = this->info;
+    return 0;
+  }
+
+  int application( unsigned index ) {
+    if ( index < descriptor.applications.size() )
+      return descriptor.applications[ index ];
+    errno = EINVAL;
+    return -1;
+  }
+
+  int report_info( hiddev_report_info& info ) {
+    unsigned key = info.report_type << 8;
+    map< unsigned, RawReport >::const_iterator it;
+    if ( info.report_id == HID_REPORT_ID_FIRST )
+      it = descriptor.reports.lower_bound( key );
+    else if ( info.report_id & HID_REPORT_ID_NEXT )
+      it = descriptor.reports.upper_bound( key |
+                                           ( info.report_id &
+                                             HID_REPORT_ID_MASK ));
+    else
+      it = descriptor.reports.find( key | info.report_id );
+
+    if ( it == descriptor.reports.end() || it->first >> 8 != info.report_type ) {
+      errno = EINVAL;
+      return -1;
+    }
+    info.report_id = it->first & HID_REPORT_ID_MASK;
+    info.num_fields = it->second.fields.size();
+    return 0;
+  }
+
+  int field_info( hiddev_field_info& info ) {
+    const RawField* f = find_field( info.report_type, info.report_id,
+                                    info.field_index );
+    if ( !f )
+      return -1;
+    info.maxusage = f->codes.size();
+    info.flags = f->flags;
+    info.application = f->application;
+    info.logical_minimum = f->logical_minimum;
+    info.logical_maximum = f->logical_maximum;
+    return 0;
+  }
+
+  int usage_code( hiddev_usage_ref& ref ) {
+    const RawField* f = find_field( ref.report_type, ref.report_id,
+                                    ref.field_index );
+    if ( !f || ref.usage_index >= f->codes.size() ) {
+      errno = EINVAL;
+      return -1;
+    }
+    ref.usage_code = f->codes[ ref.usage_index ];
+    return 0;
+  }
+
+  int get_usage( hiddev_usage_ref& ref ) {
+    if ( usage_code( ref ) < 0 )
+      return -1;
+    const RawField* f = find_field( ref.report_type, ref.report_id,
+                                    ref.field_index );
+    ref.value = ref.usage_index < f->count ?
+      raw_value( copy_of( ref.report_type, ref.report_id ), *f,
+                 ref.usage_index ) : 0;
+    return 0;
+  }
+
+  int set_usage( const hiddev_usage_ref& ref ) {
+    hiddev_usage_ref r = ref;
+    if ( usage_code( r ) < 0 )
+      return -1;
+    const RawField* f = find_field( ref.report_type, ref.report_id,
+                                    ref.field_index );
+    if ( ref.usage_index < f->count )
+      set_raw_value( copy_of( ref.report_type, ref.report_id ), *f,
+                     ref.usage_index, ref.value );
+    return 0;
+  }
+
+  /** @return whether the field holds the values, as the kernel checks */
+  bool values_fit( const hiddev_usage_ref_multi& multi ) {
+    const RawField* f = find_field( multi.uref.report_type,
+                                    multi.uref.report_id,
+                                    multi.uref.field_index );
+    if ( f && multi.num_values <= HID_MAX_MULTI_USAGES &&
+         multi.uref.usage_index + multi.num_values <= f->count )
+      return true;
+    errno = EINVAL;
+    return false;
+  }
+
+  int get_usages( hiddev_usage_ref_multi& multi ) {
+    return values_fit( multi ) ? Backend::get_usages( multi ) : -1;
+  }
+
+  int set_usages( const hiddev_usage_ref_multi& multi ) {
+    return values_fit( multi ) ? Backend::set_usages( multi ) : -1;
+  }
+
+  int get_report( const hiddev_report_info& info ) {
+    if ( !find_report( info.report_type, info.report_id ))
+      return -1;
+    return transfer( info.report_type,
+                     copy_of( info.report_type, info.report_id ), true );
+  }
+
+  int set_report( const hiddev_report_info& info ) {
+    if ( !find_report( info.report_type, info.report_id ))
+      return -1;
+    return transfer( info.report_type,
+                     copy_of( info.report_type, info.report_id ), false );
+  }
+};
+
+/** The hidraw driver, one ioctl per report. hidraw does not tell the release
+ * of the device. */
+struct HidrawBackend : RawBackend {
+  int fd;
+
+  HidrawBackend( int fd_, const hidraw_devinfo& raw_info ) : fd( fd_ ) {
+    info.bustype = raw_info.bustype;
+    info.vendor = raw_info.vendor;
+    info.product = raw_info.product;
+
+    hidraw_report_descriptor desc;
+    memset( &desc, 0, sizeof( desc ));
+    if ( ioctl( fd, HIDIOCGRDESCSIZE, &desc.size ) < 0 ||
+         ioctl( fd, HIDIOCGRDESC, &desc ) < 0 )
+      desc.size = 0;
+    describe( desc.value, desc.size );
+  }
+
+  int transfer( unsigned type, vector< unsigned char >& report, bool get ) {
+    unsigned long request;
+    switch ( type ) {
+    case HID_REPORT_TYPE_INPUT:
+      request = get ? HIDIOCGINPUT( report.size() ) :
+        HIDIOCSINPUT( report.size() );
+      break;
+    case HID_REPORT_TYPE_OUTPUT:
+      request = get ? HIDIOCGOUTPUT( report.size() ) :
+        HIDIOCSOUTPUT( report.size() );
+      break;
+    default:
+      request = get ? HIDIOCGFEATURE( report.size() ) :
+        HIDIOCSFEATURE( report.size() );
+    }
+    return ioctl( fd, request, &report[ 0 ] ) < 0 ? -1 : 0;
+  }
+
+  /** hidraw knows the serial number as uniq */
+  string serial() {
+    char uniq[ 256 ] = "";
+    return ioctl( fd, HIDIOCGRAWUNIQ( sizeof( uniq )), uniq ) > 1 ? uniq : "";
+  }
+};
+
+/** Control transfers through usbfs to the first HID interface, one per
+ * report. The interface is claimed, which fails while a driver like usbhid is
+ * bound to it. */
+struct UsbfsBackend : RawBackend {
+  int fd;
+  unsigned interface;
+
+  UsbfsBackend( int fd_ ) : fd( fd_ ), interface( 0 ) { }
+
+  /** Sends a control transfer to the interface
+   * @return bytes transferred, -1 with errno set on failure
+   */
+  int control( unsigned request_type, unsigned request, unsigned value,
+               void* data, unsigned length ) {
+    usbdevfs_ctrltransfer ctrl;
+    memset( &ctrl, 0, sizeof( ctrl ));
+    ctrl.bRequestType = request_type;
+    ctrl.bRequest = request;
+    ctrl.wValue = value;
+    ctrl.wIndex = interface;
+    ctrl.wLength = length;
+    ctrl.timeout = USB_TIMEOUT_MS;
+    ctrl.data = data;
+    return ioctl( fd, USBDEVFS_CONTROL, &ctrl );
+  }
+
+  /** Reads the descriptors and claims the HID interface
+   * @return false if the interface cannot be used, errno is set then (ENODEV
+   *         if the device has no HID interface)
+   */
+  bool attach() {
+    /* reading gives the device descriptor followed by the configurations */
+    unsigned char desc[ 4096 ];
+    ssize_t size = read( fd, desc, sizeof( desc ));
+    if ( size < 0 )
+      return false;
+    if ( size < 18 ) {
+      errno = ENODEV;
+      return false;
+    }
+    info.vendor = desc[ 8 ] | desc[ 9 ] << 8;
+    info.product = desc[ 10 ] | desc[ 11 ] << 8;
+    info.version = desc[ 12 ] | desc[ 13 ] << 8;
+
+    /* the HID descriptor follows its interface and tells the size of the
+     * report descriptor */
+    bool hid = false;
+    unsigned report_size = 0;
+    for ( ssize_t i = desc[ 0 ]; i + 9 <= size && desc[ i ] >= 2;
+          i += desc[ i ] ) {
+      if ( desc[ i + 1 ] == USB_DT_INTERFACE ) {
+        hid = desc[ i + 5 ] == USB_INTERFACE_CLASS_HID;
+        interface = desc[ i + 2 ];
+      } else if ( desc[ i + 1 ] == HID_DT_HID && hid ) {
+        report_size = desc[ i + 7 ] | desc[ i + 8 ] << 8;
+        break;
+      }
+    }
+    if ( !report_size ) {
+      errno = ENODEV;   /* not a HID device */
+      return false;
+    }
+
+    vector< unsigned char > report_desc( min( report_size, 4096u ));
+    int length;
+    if ( ioctl( fd, USBDEVFS_CLAIMINTERFACE, &interface ) < 0 ||
+         ( length = control( USB_DIR_IN | USB_RECIP_INTERFACE,
+                             USB_REQ_GET_DESCRIPTOR, HID_DT_REPORT << 8,
+                             &report_desc[ 0 ], report_desc.size() )) < 0 )
+      return false;
+
+    describe( &report_desc[ 0 ], length );
+    return true;
+  }
+
+  /** GET_REPORT/SET_REPORT with the HID report type as hiddev numbers it;
+   * the id byte is only on the wire if the device numbers its reports */
+  int transfer( unsigned type, vector< unsigned char >& report, bool get ) {
+    size_t skip = report[ 0 ] ? 0 : 1;
+    return control( USB_TYPE_CLASS | USB_RECIP_INTERFACE |
+                    ( get ? USB_DIR_IN : USB_DIR_OUT ),
+                    get ? HID_REQ_GET_REPORT : HID_REQ_SET_REPORT,
+                    type << 8 | report[ 0 ], &report[ skip ],
+                    report.size() - skip ) < 0 ? -1 : 0;
+  }
+};
+
+/** Shapes of the jitter of the simulated displays */
+enum { JITTER_UNIFORM, JITTER_NORMAL, JITTER_EXPONENTIAL };
+
+const char* JITTER_NAMES[] = { "uniform", "normal", "exponential" };
+
+/** Displays simulated by the mock backend, as --backend=mock:<spec> sets
+ * them up */
+struct MockSpec {
+  bool enabled;
+  const DeviceId* device;   // model the displays pretend to be
+  unsigned displays;        // found by --auto as mock0, mock1, ...
+  int brightness;           // at start, -1 for the middle of the range
+  double latency_ms;        // each open and transfer takes at least that
+  double jitter_ms;         // added on top, drawn from the distribution
+  int jitter;               // JITTER_UNIFORM, JITTER_NORMAL, ...
+  double eio_percent;       // of transfers failing with EIO
+  unsigned unplug_after;    // transfers until the display is gone, 0 never
+  bool first_read_zero;     // first report read from a display is zero
+  bool no_descriptor;       // displays give no report descriptor
+  unsigned granularity;     // display takes multiples of it only, 0 for 1
+  unsigned settle_ms;       // old value is read back for that long
+  unsigned seed;            // of the random numbers
+
+  MockSpec()
+    : enabled( false )
+    , device( 0 )
+    , displays( 1 )
+    , brightness( -1 )
+    , latency_ms( 0 )
+    , jitter_ms( 0 )
+    , jitter( JITTER_UNIFORM )
+    , eio_percent( 0 )
+    , unplug_after( 0 )
+    , first_read_zero( false )
+    , no_descriptor( false )
+    , granularity( 0 )
+    , settle_ms( 0 )
+    , seed( 1 )
+    { }
+};
+
+MockSpec mock_spec;
+
+/** Report of a mock display */
+struct MockReport {
+  vector< unsigned char > value;  // as the display has it
+  vector< unsigned char > shown;  // as it is read back until settled
+  uint64_t settled_ns;
+
+  MockReport() : settled_ns( 0 ) { }
+};
+
+/** Mock display, it outlives opening and closing it as a device would */
+struct MockDisplay {
+  map< unsigned, MockReport > reports;  // by type << 8 | id
+  unsigned transfers;
+  bool read;                            // a report was read from it
+
+  MockDisplay() : transfers( 0 ), read( false ) { }
+};
+
+/** Mock displays by path */
+map< string, MockDisplay > mock_displays;
+/** Guards the mock displays and the random numbers */
+mutex mock_lock;
+
+/** @return random numbers of the faults and delays, reproducible by the
+ *          seed; built on first use, so runs without mock displays do not
+ *          pay for the state */
+mt19937& mock_random() {
+  static mt19937 random( mock_spec.seed );
+  return random;
+}
+
+/** Parses a non-negative number of a mock spec key
+ * @return false if the value is none */
+bool mock_value( const string& text, double& value ) {
+  char* end;
+  value = strtod( text.c_str(), &end );
+  return !text.empty() && *end == 0 && value >= 0;
+}
+
+/** Parses the spec of --backend=mock:<spec>, a comma separated list of
+ *   model=<name>        model from the database, CINEMA_DISPLAY_30 by default
+ *   displays=<n>        number of displays found by --auto, 1 by default
+ *   brightness=<n>      brightness at start, the middle of the range by default
+ *   latency=<ms>        time every open and transfer takes
+ *   jitter=<ms>         added to the latency, uniform in [0, <ms>) by default
+ *   distribution=<name> of the jitter: uniform, normal (<ms> is the standard
+ *                       deviation, negative values are mirrored) or
+ *                       exponential (<ms> is the mean)
+ *   eio=<percent>       of the transfers failing with EIO
+ *   unplug-after=<n>    transfers of each display, later ones fail with
+ *                       ENODEV and opening it with ENOENT
+ *   first-read-zero     the first report read from a display is zero
+ *   no-descriptor       displays give no report descriptor, the brightness
+ *                       report of the database is assumed
+ *   granularity=<n>     displays take multiples of <n> only
+ *   settle=<ms>         the previous value is read back for <ms> after a write
+ *   seed=<n>            of the random jitter and faults, 1 by default
+ * @return false if the spec is malformed
+ */
+bool parse_mock_spec( const string& spec ) {
+  mock_spec.enabled = true;
+  mock_spec.device = find_device( APPLE, CINEMA_DISPLAY_30 );
+
+  istringstream in( spec );
+  string item;
+  while ( getline( in, item, ',' )) {
+    size_t eq = item.find( '=' );
+    string key = item.substr( 0, eq );
+    string value = eq == string::npos ? "" : item.substr( eq + 1 );
+    double n;
+    bool valid = mock_value( value, n );
+
+    if ( key == "model" && find_model( value ))
+      mock_spec.device = find_model( value );
+    else if ( key == "displays" && valid )
+      mock_spec.displays = (unsigned)n;
+    else if ( key == "brightness" && valid )
+      mock_spec.brightness = (int)n;
+    else if ( key == "latency" && valid )
+      mock_spec.latency_ms = n;
+    else if ( key == "jitter" && valid )
+      mock_spec.jitter_ms = n;
+    else if ( key == "distribution" ) {
+      int i = JITTER_EXPONENTIAL;
+      while ( i >= 0 && value != JITTER_NAMES[ i ] )
+        --i;
+      if ( i < 0 )
+        return false;
+      mock_spec.jitter = i;
+    } else if ( key == "eio" && valid && n <= 100 )
+      mock_spec.eio_percent = n;
+    else if ( key == "unplug-after" && valid )
+      mock_spec.unplug_after = (unsigned)n;
+    else if ( item == "first-read-zero" )
+      mock_spec.first_read_zero = true;
+    else if ( item == "no-descriptor" )
+      mock_spec.no_descriptor = true;
+    else if ( key == "granularity" && valid )
+      mock_spec.granularity = (unsigned)n;
+    else if ( key == "settle" && valid )
+      mock_spec.settle_ms = (unsigned)n;
+    else if ( key == "seed" && valid )
+      mock_spec.seed = (unsigned)n;
+    else if ( !item.empty() )
+      return false;
+  }
+  return true;
+}
+
+/** Draws the time the next operation on a mock display takes, call with
+ * mock_lock held
+ * @return time in nanoseconds
+ */
+uint64_t mock_delay_ns() {
+  double ms = mock_spec.latency_ms;
+  double jitter = mock_spec.jitter_ms;
+  if ( jitter > 0 ) {
+    switch ( mock_spec.jitter ) {
+    case JITTER_UNIFORM:
+      ms += uniform_real_distribution< double >( 0, jitter )( mock_random() );
+      break;
+    case JITTER_NORMAL:
+      ms += fabs( normal_distribution< double >( 0, jitter )( mock_random() ));
+      break;
+    case JITTER_EXPONENTIAL:
+      ms += exponential_distribution< double >( 1 / jitter )( mock_random() );
+      break;
+    }
+  }
+  return (uint64_t)( ms * 1000000 );
+}
+
+/** Waits as long as an operation on a mock display takes */
+void mock_delay() {
+  uint64_t ns;
+  {
+    lock_guard< mutex > guard( mock_lock );
+    ns = mock_delay_ns();
+  }
+  if ( ns )
+    usleep( ns / 1000 );
+}
+
+/** Display kept in memory. It describes a single feature report holding the
+ * brightness, which goes through the same emulation as hidraw and usbfs.
+ * Transfers behave as the spec says, with delays, faults and the quirks
+ * of real displays. */
+struct MockBackend : RawBackend {
+  string path;
+
+  MockBackend( const string& path_ ) : path( path_ ) {
+    const DeviceId* device = mock_spec.device;
+    int lo = device->brightness_min;
+    int hi = device->brightness_max;
+    info.bustype = 3;       /* BUS_USB */
+    info.vendor = device->vendor;
+    info.product = device->product;
+    info.version = device->release;
+
+    const unsigned char desc[] = {
+      0x05, 0x80, 0x09, 0x01, 0xA1, 0x01,         /* monitor application */
+      0x85, BRIGHTNESS_CONTROL,
+      0x05, 0x82, 0x09, 0x10,                     /* brightness */
+      0x16, (unsigned char)lo, (unsigned char)( lo >> 8 ),
+      0x26, (unsigned char)hi, (unsigned char)( hi >> 8 ),
+      0x75, 0x10, 0x95, 0x01, 0xB1, 0x02,         /* 16 bit variable */
+      0xC0
+    };
+    describe( desc, mock_spec.no_descriptor ? 0 : sizeof( desc ));
+
+    lock_guard< mutex > guard( mock_lock );
+    map< unsigned, MockReport >& reports = mock_displays[ path ].reports;
+    if ( reports.empty() ) {
+      hiddev_usage_ref ref;
+      memset( &ref, 0, sizeof( ref ));
+      ref.report_type = HID_REPORT_TYPE_FEATURE;
+      ref.report_id = BRIGHTNESS_CONTROL;
+      ref.value = mock_spec.brightness >= 0 ? mock_spec.brightness :
+        ( lo + hi ) / 2;
+      set_usage( ref );
+      for ( map< unsigned, vector< unsigned char > >::iterator it =
+              copies.begin(); it != copies.end(); ++it )
+        reports[ it->first ].value = it->second;
+      copies.clear();
+    }
+  }
+
+  /** @return whether the display was unplugged */
+  static bool unplugged( const string& path ) {
+    lock_guard< mutex > guard( mock_lock );
+    return mock_spec.unplug_after &&
+      mock_displays[ path ].transfers >= mock_spec.unplug_after;
+  }
+
+  /** Answers GET_REPORT as the display would */
+  void read_report( MockDisplay& m, MockReport& r,
+                    vector< unsigned char >& report ) {
+    bool zero = mock_spec.first_read_zero && !m.read;
+    m.read = true;
+    const vector< unsigned char >& value =
+      now_ns() < r.settled_ns ? r.shown : r.value;
+    if ( zero )
+      fill( report.begin() + 1, report.end(), 0 );
+    else if ( !value.empty() )
+      report = value;
+  }
+
+  /** Takes SET_REPORT as the display would */
+  void write_report( unsigned type, MockReport& r,
+                     const vector< unsigned char >& report ) {
+    vector< unsigned char > value = report;
+    const RawReport* desc = find_report( type, report[ 0 ] );
+    int step = mock_spec.granularity;
+    for ( size_t i = 0; step > 1 && i < desc->fields.size(); ++i ) {
+      const RawField& f = desc->fields[ i ];
+      for ( unsigned j = 0; j < f.count; ++j )
+        set_raw_value( value, f, j, raw_value( value, f, j ) / step * step );
+    }
+
+    if ( mock_spec.settle_ms ) {
+      uint64_t now = now_ns();
+      if ( now >= r.settled_ns )
+        r.shown = r.value;
+      r.settled_ns = now + mock_spec.settle_ms * 1000000ULL;
+    }
+    r.value = value;
+  }
+
+  int transfer( unsigned type, vector< unsigned char >& report, bool get ) {
+    int error = 0;
+    uint64_t ns;
+    {
+      lock_guard< mutex > guard( mock_lock );
+      MockDisplay& m = mock_displays[ path ];
+      MockReport& r = m.reports[ type << 8 | report[ 0 ] ];
+      ns = mock_delay_ns();
+      if ( mock_spec.unplug_after && m.transfers >= mock_spec.unplug_after )
+        error = ENODEV;
+      else if ( mock_spec.eio_percent > 0 &&
+                uniform_real_distribution< double >( 0, 100 )( mock_random() ) <
+                mock_spec.eio_percent )
+        error = EIO;
+      else if ( get )
+        read_report( m, r, report );
+      else
+        write_report( type, r, report );
+      ++m.transfers;
+    }
+
+    /* the display answers only after the delay, as over USB */
+    if ( ns )
+      usleep( ns / 1000 );
+    errno = error;
+    return error ? -1 : 0;
+  }
+
+  string serial() { return path; }
+};
+
+/** Operations of a trace, one per Backend call */
+enum {
+  TRACE_OPEN, TRACE_VERSION, TRACE_DEVINFO, TRACE_APPLICATION,
+  TRACE_INIT_REPORT, TRACE_REPORT_INFO, TRACE_FIELD_INFO, TRACE_USAGE_CODE,
+  TRACE_GET_USAGE, TRACE_SET_USAGE, TRACE_GET_REPORT, TRACE_SET_REPORT,
+  TRACE_GET_USAGES, TRACE_SET_USAGES, TRACE_ENABLE_EVENTS, TRACE_SERIAL
+};
+
+const char TRACE_MAGIC[ 8 ] = { 'A', 'C', 'D', 'T', 'R', 'C', '1', 0 };
+
+/** Operation in a trace file, in host byte order as the device database.
+ * It is followed by its data: the path for TRACE_OPEN, the index for
+ * TRACE_APPLICATION, the serial for TRACE_SERIAL and the argument as the
+ * operation left it for the others, multi usage references without the
+ * unused values. */
+struct TraceRecord {
+  uint64_t start_ns;        // since the trace was started
+  uint32_t duration_ns;
+  uint16_t node;            // open the operation belongs to, from 0 on
+  uint8_t op;               // TRACE_*
+  uint8_t reserved;
+  int32_t result;
+  int32_t error;            // errno if result is negative
+  uint32_t size;            // of the data
+  uint32_t reserved2;
+};
+
+/** Trace written by --record, NULL if none */
+FILE* trace_file = 0;
+uint64_t trace_start_ns = 0;
+unsigned trace_nodes = 0;           // opens recorded so far
+mutex trace_lock;
+
+/** Starts the trace of --record
+ * @return false if the file cannot be written, errno set */
+bool start_trace( const char* path ) {
+  if ( !( trace_file = fopen( path, "w" )))
+    return false;
+  trace_start_ns = now_ns();
+  return fwrite( TRACE_MAGIC, sizeof( TRACE_MAGIC ), 1, trace_file ) == 1;
+}
+
+/** Appends an operation to the trace
+ * @param start when the operation started
+ */
+void write_trace( unsigned node, unsigned op, uint64_t start, int result,
+                  int error, const void* data, size_t size ) {
+  TraceRecord r;
+  memset( &r, 0, sizeof( r ));
+  r.start_ns = start - trace_start_ns;
+  r.duration_ns = min( now_ns() - start, (uint64_t)UINT32_MAX );
+  r.node = node;
+  r.op = op;
+  r.result = result;
+  r.error = result < 0 ? error : 0;
+  r.size = size;
+
+  lock_guard< mutex > guard( trace_lock );
+  fwrite( &r, sizeof( r ), 1, trace_file );
+  fwrite( data, size, 1, trace_file );
+}
+
+/** @return size of the used part of a multi usage reference */
+size_t multi_size( const hiddev_usage_ref_multi& multi ) {
+  return offsetof( hiddev_usage_ref_multi, values ) +
+    min( multi.num_values, (unsigned)HID_MAX_MULTI_USAGES ) *
+    sizeof( multi.values[ 0 ] );
+}
+
+/** Writes every operation of another backend to the trace of --record */
+struct RecordingBackend : Backend {
+  shared_ptr< Backend > inner;
+  unsigned node;
+
+  RecordingBackend( shared_ptr< Backend > inner_, unsigned node_ )
+    : inner( inner_ ), node( node_ ) { }
+
+  /** Records an operation which started at start
+   * @return result, with errno as the operation left it */
+  int record( unsigned op, uint64_t start, int result, const void* data = 0,
+              size_t size = 0 ) {
+    int error = errno;
+    write_trace( node, op, start, result, error, data, size );
+    errno = error;
+    return result;
+  }
+
+  int version() {
+    uint64_t start = now_ns();
+    return record( TRACE_VERSION, start, inner->version() );
+  }
+  int devinfo( hiddev_devinfo& info ) {
+    uint64_t start = now_ns();
+    return record( TRACE_DEVINFO, start, inner->devinfo( info ), &info,
+                   sizeof( info ));
+  }
+  int application( unsigned index ) {
+    uint64_t start = now_ns();
+    uint32_t i = index;
+    return record( TRACE_APPLICATION, start, inner->application( index ), &i,
+                   sizeof( i ));
+  }
+  int init_report() {
+    uint64_t start = now_ns();
+    return record( TRACE_INIT_REPORT, start, inner->init_report() );
+  }
+  int report_info( hiddev_report_info& info ) {
+    uint64_t start = now_ns();
+    return record( TRACE_REPORT_INFO, start, inner->report_info( info ),
+                   &info, sizeof( info ));
+  }
+  int field_info( hiddev_field_info& info ) {
+    uint64_t start = now_ns();
+    return record( TRACE_FIELD_INFO, start, inner->field_info( info ), &info,
+                   sizeof( info ));
+  }
+  int usage_code( hiddev_usage_ref& ref ) {
+    uint64_t start = now_ns();
+    return record( TRACE_USAGE_CODE, start, inner->usage_code( ref ), &ref,
+                   sizeof( ref ));
+  }
+  int get_usage( hiddev_usage_ref& ref ) {
+    uint64_t start = now_ns();
+    return record( TRACE_GET_USAGE, start, inner->get_usage( ref ), &ref,
+                   sizeof( ref ));
+  }
+  int set_usage( const hiddev_usage_ref& ref ) {
+    uint64_t start = now_ns();
+    return record( TRACE_SET_USAGE, start, inner->set_usage( ref ), &ref,
+                   sizeof( ref ));
+  }
+  int get_report( const hiddev_report_info& info ) {
+    uint64_t start = now_ns();
+    return record( TRACE_GET_REPORT, start, inner->get_report( info ), &info,
+                   sizeof( info ));
+  }
+  int set_report( const hiddev_report_info& info ) {
+    uint64_t start = now_ns();
+    return record( TRACE_SET_REPORT, start, inner->set_report( info ), &info,
+                   sizeof( info ));
+  }
+  int get_usages( hiddev_usage_ref_multi& multi ) {
+    uint64_t start = now_ns();
+    return record( TRACE_GET_USAGES, start, inner->get_usages( multi ),
+                   &multi, multi_size( multi ));
+  }
+  int set_usages( const hiddev_usage_ref_multi& multi ) {
+    uint64_t start = now_ns();
+    return record( TRACE_SET_USAGES, start, inner->set_usages( multi ),
+                   &multi, multi_size( multi ));
+  }
+  int enable_events() {
+    uint64_t start = now_ns();
+    return record( TRACE_ENABLE_EVENTS, start, inner->enable_events() );
+  }
+  string serial() {
+    uint64_t start = now_ns();
+    string s = inner->serial();
+    record( TRACE_SERIAL, start, 0, s.data(), s.size() );
+    return s;
+  }
+};
+
+/** Operation read from a trace */
+struct TraceEntry {
+  TraceRecord record;
+  string data;
+};
+
+/** Largest data of an operation, that of a multi usage reference */
+const size_t TRACE_MAX_DATA = sizeof( hiddev_usage_ref_multi ) + PATH_MAX;
+
+/** Trace served by --backend=replay:<file> */
+struct ReplayTrace {
+  bool enabled;
+  bool fast;                                  // do not wait as recorded
+  uint64_t start_ns;                          // the replay started
+  vector< TraceEntry > entries;
+  vector< string > paths;                     // in the order first opened
+  map< string, list< size_t > > opens;        // TRACE_OPEN entries by path
+  map< unsigned, list< size_t > > operations; // other entries by node
+
+  ReplayTrace() : enabled( false ), fast( false ), start_ns( 0 ) { }
+};
+
+ReplayTrace replay_trace;
+mutex replay_lock;
+
+/** Loads the trace of --backend=replay:<file>[,fast]
+ * @return false if it is no trace file or a damaged one
+ */
+bool load_replay_trace( const string& spec ) {
+  string path = spec;
+  replay_trace.enabled = true;
+  if ( path.size() > 5 && path.compare( path.size() - 5, 5, ",fast" ) == 0 ) {
+    replay_trace.fast = true;
+    path.erase( path.size() - 5 );
+  }
+
+  ifstream in( path.c_str(), ios::binary | ios::ate );
+  streamoff left = in.tellg();
+  in.seekg( 0 );
+  char magic[ sizeof( TRACE_MAGIC ) ];
+  if ( !in.read( magic, sizeof( magic )) ||
+       memcmp( magic, TRACE_MAGIC, sizeof( magic )) != 0 )
+    return false;
+
+  left -= sizeof( magic );
+  TraceEntry e;
+  while ( in.read( (char*)&e.record, sizeof( e.record ))) {
+    left -= sizeof( e.record );
+    if ( e.record.size > TRACE_MAX_DATA || e.record.size > left )
+      return false;
+    left -= e.record.size;
+    e.data.resize( e.record.size );
+    if ( !in.read( &e.data[ 0 ], e.data.size() ))
+      return false;
+
+    size_t index = replay_trace.entries.size();
+    if ( e.record.op == TRACE_OPEN ) {
+      if ( !replay_trace.opens.count( e.data ))
+        replay_trace.paths.push_back( e.data );
+      replay_trace.opens[ e.data ].push_back( index );
+    } else
+      replay_trace.operations[ e.record.node ].push_back( index );
+    replay_trace.entries.push_back( e );
+  }
+  replay_trace.start_ns = now_ns();
+  return in.eof() && left == 0;
+}
+
+/** Takes the next operation of a node or path from the trace. Unless
+ * replaying fast, it starts no earlier than it did when recorded, counted
+ * from the start of the program, and takes as long as it took then.
+ * @param queues operations left by node or path
+ * @param arg argument the operation is called with, compared with the
+ *        recorded one; NULL if the operation has no input to compare
+ * @return the entry, NULL with errno set if the trace has another operation
+ *         next, one with another argument or none
+ */
+template < class Key >
+const TraceEntry* replay_next( map< Key, list< size_t > >& queues,
+                               const Key& key, unsigned op,
+                               const void* arg = 0, size_t size = 0 ) {
+  const TraceEntry* e = 0;
+  {
+    lock_guard< mutex > guard( replay_lock );
+    typename map< Key, list< size_t > >::iterator it = queues.find( key );
+    if ( it != queues.end() && !it->second.empty() ) {
+      const TraceEntry& next = replay_trace.entries[ it->second.front() ];
+      if ( next.record.op == op &&
+           ( !arg || ( next.data.size() == size &&
+                       memcmp( next.data.data(), arg, size ) == 0 ))) {
+        e = &next;
+        it->second.pop_front();
+      }
+    }
+  }
+  if ( !e ) {
+    errno = EPROTO;
+    return 0;
+  }
+
+  if ( !replay_trace.fast ) {
+    uint64_t start = replay_trace.start_ns + e->record.start_ns;
+    uint64_t now = now_ns();
+    uint64_t ns = ( start > now ? start - now : 0 ) + e->record.duration_ns;
+    if ( ns )
+      usleep( ns / 1000 );
+  }
+  return e;
+}
+
+/** Display of a trace, every operation answers as it did when recorded.
+ * The operations of a display have to come in the recorded order. */
+struct ReplayBackend : Backend {
+  unsigned node;
+
+  ReplayBackend( unsigned node_ ) : node( node_ ) { }
+
+  /** Replays the next operation
+   * @param data receives the data of the operation, NULL to ignore it
+   * @return recorded result, errno set as recorded
+   */
+  int replay( unsigned op, void* data = 0, size_t size = 0 ) {
+    const TraceEntry* e = replay_next( replay_trace.operations, node, op );
+    if ( !e )
+      return -1;
+    if ( data )
+      memcpy( data, e->data.data(), min( size, e->data.size() ));
+    errno = e->record.error;
+    return e->record.result;
+  }
+
+  /** Replays the next operation if it was called with the same argument
+   * @return recorded result, errno set as recorded
+   */
+  int replay_with( unsigned op, const void* arg, size_t size ) {
+    const TraceEntry* e = replay_next( replay_trace.operations, node, op,
+                                       arg, size );
+    if ( !e )
+      return -1;
+    errno = e->record.error;
+    return e->record.result;
+  }
+
+  int version() { return max( replay( TRACE_VERSION ), 0 ); }
+  int devinfo( hiddev_devinfo& info ) {
+    return replay( TRACE_DEVINFO, &info, sizeof( info ));
+  }
+  int application( unsigned index ) {
+    uint32_t i = index;
+    return replay_with( TRACE_APPLICATION, &i, sizeof( i ));
+  }
+  int init_report() { return replay( TRACE_INIT_REPORT ); }
+  int report_info( hiddev_report_info& info ) {
+    return replay( TRACE_REPORT_INFO, &info, sizeof( info ));
+  }
+  int field_info( hiddev_field_info& info ) {
+    return replay( TRACE_FIELD_INFO, &info, sizeof( info ));
+  }
+  int usage_code( hiddev_usage_ref& ref ) {
+    return replay( TRACE_USAGE_CODE, &ref, sizeof( ref ));
+  }
+  int get_usage( hiddev_usage_ref& ref ) {
+    return replay( TRACE_GET_USAGE, &ref, sizeof( ref ));
+  }
+  int set_usage( const hiddev_usage_ref& ref ) {
+    return replay_with( TRACE_SET_USAGE, &ref, sizeof( ref ));
+  }
+  int get_report( const hiddev_report_info& info ) {
+    return replay_with( TRACE_GET_REPORT, &info, sizeof( info ));
+  }
+  int set_report( const hiddev_report_info& info ) {
+    return replay_with( TRACE_SET_REPORT, &info, sizeof( info ));
+  }
+  int get_usages( hiddev_usage_ref_multi& multi ) {
+    return replay( TRACE_GET_USAGES, &multi, sizeof( multi ));
+  }
+  int set_usages( const hiddev_usage_ref_multi& multi ) {
+    return replay_with( TRACE_SET_USAGES, &multi, multi_size( multi ));
+  }
+  int enable_events() { return replay( TRACE_ENABLE_EVENTS ); }
+  string serial() {
+    const TraceEntry* e = replay_next( replay_trace.operations, node,
+                                       TRACE_SERIAL );
+    return e ? e->data : "";
+  }
+};
+
+/** Opens a display of the trace the way it was opened when recorded
+ * @return the backend, NULL with errno set if opening failed then or the
+ *         trace has no more opens of the path
+ */
+shared_ptr< Backend > open_replay( const string& path, int& fd ) {
+  const TraceEntry* e = replay_next( replay_trace.opens, path, TRACE_OPEN );
+  if ( !e ) {
+    errno = ENOENT;
+    return 0;
+  }
+  if ( e->record.result < 0 ) {
+    errno = e->record.error;
+    return 0;
+  }
+  if (( fd = eventfd( 0, EFD_CLOEXEC )) < 0 )
+    return 0;
+  return shared_ptr< Backend >( new ReplayBackend( e->record.node ));
+}
+
+/** Opens the device node with the backend it belongs to
+ * @param fd receives the file descriptor of the node; mock displays get an
+ *        eventfd which never fires, so they are polled like any other
+ * @return the backend, NULL with errno set if the node cannot be opened
+ */
+shared_ptr< Backend > open_node( const string& path, int open_mode,
+                                 int& fd ) {
+  if ( mock_spec.enabled ) {
+    mock_delay();
+    if ( MockBackend::unplugged( path )) {
+      errno = ENOENT;
+      return 0;
+    }
+    if (( fd = eventfd( 0, EFD_CLOEXEC )) < 0 )
+      return 0;
+    return shared_ptr< Backend >( new MockBackend( path ));
+  }
+
+  if (( fd = open( path.c_str(), open_mode )) < 0 )
+    return 0;
+
+  struct stat st;
+  if ( fstat( fd, &st ) == 0 && S_ISCHR( st.st_mode ) &&
+       major( st.st_rdev ) == USB_DEVICE_MAJOR ) {
+    UsbfsBackend* usbfs = new UsbfsBackend( fd );
+    shared_ptr< Backend > backend( usbfs );
+    if ( usbfs->attach() )
+      return backend;
+    int error = errno;
+    close( fd );
+    fd = -1;
+    errno = error;
+    return 0;
+  }
+
+  /* hiddev and hidraw share the ioctl numbers partly, so the node is told
+   * apart by the one call only hidraw answers before any other */
+  hidraw_devinfo raw_info;
+  if ( ioctl( fd, HIDIOCGRAWINFO, &raw_info ) == 0 )
+    return shared_ptr< Backend >( new HidrawBackend( fd, raw_info ));
+  return shared_ptr< Backend >( new HiddevBackend( fd ));
+}
+
+/** Opens the device node, from the trace when replaying and recording the
+ * operations with --record
+ * @param fd receives the file descriptor of the node
+ * @return the backend, NULL with errno set if the node cannot be opened
+ */
+shared_ptr< Backend > open_backend( const string& path, int open_mode,
+                                    int& fd ) {
+  if ( replay_trace.enabled )
+    return open_replay( path, fd );
+
+  uint64_t start = now_ns();
+  shared_ptr< Backend > backend = open_node( path, open_mode, fd );
+  if ( !trace_file )
+    return backend;
+
+  unsigned node;
+  {
+    lock_guard< mutex > guard( trace_lock );
+    node = trace_nodes++;
+  }
+  int error = errno;
+  write_trace( node, TRACE_OPEN, start, backend ? 0 : -1, error,
+               path.data(), path.size() );
+  errno = error;
+  return backend ?
+    shared_ptr< Backend >( new RecordingBackend( backend, node )) : backend;
+}
+
+/** Finds the number of values of a field. hiddev tells the usages only: a
+ * variable field has a value for each, an array field may have fewer, which
+ * is searched for with the largest read of its usages the kernel takes.
+ * @return values of the field, 0 if none can be read
+ */
+unsigned field_report_count( Backend& b, const hiddev_field_info& info ) {
+  if ( info.flags & HID_FIELD_VARIABLE )
+    return info.maxusage;
+
+  hiddev_usage_ref_multi multi;
+  memset( &multi.uref, 0, sizeof( multi.uref ));
+  multi.uref.report_type = info.report_type;
+  multi.uref.report_id = info.report_id;
+  multi.uref.field_index = info.field_index;
+
+  unsigned lo = 0;
+  unsigned hi = min( info.maxusage, (unsigned)HID_MAX_MULTI_USAGES );
+  while ( lo < hi ) {
+    multi.num_values = ( lo + hi + 1 ) / 2;
+    if ( b.get_usages( multi ) < 0 )
+      hi = multi.num_values - 1;
+    else
+      lo = multi.num_values;
+  }
+  return lo;
+}
+
+/** Walks all reports, fields and usages the device describes. Reports
+ * must have been initialised by Backend::init_report().
+ * @param b backend of the opened display
+ * @param usages receives the location of every usage, the first one found
+ *        wins if a usage appears more than once
+ * @param fields receives all fields, or NULL
+ * @param dump stream to print the tree with current values to, or NULL
+ */
+void walk_reports( Backend& b, UsageMap& usages, Fields* fields, ostream* dump ) {
+  for ( size_t t = 0; t < sizeof( REPORT_TYPES ) / sizeof( *REPORT_TYPES );
+        ++t ) {
+    hiddev_report_info rep_info;
+    memset( &rep_info, 0, sizeof( rep_info ));
+    rep_info.report_type = REPORT_TYPES[ t ];
+    rep_info.report_id = HID_REPORT_ID_FIRST;
+
+    while ( b.report_info( rep_info ) >= 0 ) {
+      /* values are only fetched for the dump, probing stays read-free */
+      bool values = dump && b.get_report( rep_info ) >= 0;
+      if ( dump )
+        *dump << "  " << report_type_name( rep_info.report_type )
+              << " report " << dec << rep_info.report_id << ", "
+              << rep_info.num_fields << " field(s)" << endl;
+
+      for ( unsigned f = 0; f < rep_info.num_fields; ++f ) {
+        hiddev_field_info field_info;
+        memset( &field_info, 0, sizeof( field_info ));
+        field_info.report_type = rep_info.report_type;
+        field_info.report_id = rep_info.report_id;
+        field_info.field_index = f;
+        if ( b.field_info( field_info ) < 0 )
+          continue;
+
+        Field field = { rep_info.report_type, rep_info.report_id, f,
+                        field_report_count( b, field_info ),
+                        vector< unsigned >( field_info.maxusage ) };
+
+        if ( dump )
+          *dump << "    Field " << dec << f << ": application "
+                << hex << showbase << field_info.application
+                << ", logical " << field_info.logical
+                << ", flags " << field_info.flags << dec
+                << ", range " << field_info.logical_minimum << ".."
+                << field_info.logical_maximum << ", "
+                << field_info.maxusage << " usage(s)" << endl;
+
+        for ( unsigned u = 0; u < field_info.maxusage; ++u ) {
+          hiddev_usage_ref usage_ref;
+          memset( &usage_ref, 0, sizeof( usage_ref ));
+          usage_ref.report_type = rep_info.report_type;
+          usage_ref.report_id = rep_info.report_id;
+          usage_ref.field_index = f;
+          usage_ref.usage_index = u;
+          if ( b.usage_code( usage_ref ) < 0 )
+            continue;
+
+          Layout layout = { rep_info.report_type, rep_info.report_id, f, u,
+                            usage_ref.usage_code, field_info.logical_minimum,
+                            field_info.logical_maximum };
+          usages.insert( UsageMap::value_type( usage_ref.usage_code,
+                                               layout ));
+          field.codes[ u ] = usage_ref.usage_code;
+          if ( !dump )
+            continue;
+
+          *dump << "      Usage " << dec << u << ": " << hex << showbase
+                << usage_ref.usage_code << dec;
+          if ( values && b.get_usage( usage_ref ) >= 0 )
+            *dump << " = " << usage_ref.value;
+          if ( usage_ref.usage_code == (unsigned)USAGE_CODE )
+            *dump << " (brightness)";
+          *dump << endl;
+        }
+        if ( fields )
+          fields->push_back( field );
+      }
+      rep_info.report_id |= HID_REPORT_ID_NEXT;
+    }
+  }
+}
+
+/** HID device opened for brightness control */
+struct Display {
+  string path;
+  int fd;
+  shared_ptr< Backend > backend;    // set while the display is open
+  int version;
+  hiddev_devinfo device_info;
+  const DeviceId* device;
+  Layout layout;
+  hiddev_usage_ref usage_ref;
+  hiddev_report_info rep_info;
+  bool primed;              // report was read or written since opening
+
+  /* relative changes coalesced by the daemon */
+  int coalesce_fd;
+  bool coalescing;
+  bool pending;
+  int target;
+
+  /* brightness ramp */
+  int fade_fd;
+  bool fading;
+  int fade_from;
+  int fade_to;
+  int fade_position;
+  uint64_t fade_start;
+  uint64_t fade_ns;
+  uint64_t frame_ns;
+  uint64_t write_ns;        // average time a write takes
+
+  /* verification of the daemon after the reply */
+  int verify_fd;
+  int verify_expected;
+
+  /* brightness cache of the daemon */
+  bool cached;
+  int cached_value;
+  uint64_t cached_at;
+
+  Display( const string& path_ = "" )
+    : path( path_ )
+    , fd( -1 )
+    , version( 0 )
+    , device( 0 )
+    , primed( false )
+    , coalesce_fd( -1 )
+    , coalescing( false )
+    , pending( false )
+    , target( 0 )
+    , fade_fd( -1 )
+    , fading( false )
+    , fade_from( 0 )
+    , fade_to( 0 )
+    , fade_position( 0 )
+    , fade_start( 0 )
+    , fade_ns( 0 )
+    , frame_ns( 0 )
+    , write_ns( 0 )
+    , verify_fd( -1 )
+    , verify_expected( 0 )
+    , cached( false )
+    , cached_value( 0 )
+    , cached_at( 0 )
+    { }
+};
+
+/** Closes the display device if it is open */
+void close_display( Display& d ) {
+  if ( d.fd >= 0 )
+    close( d.fd );
+  d.fd = -1;
+  d.backend.reset();
+}
+
+/** Opens the HID device and reads its information
+ * @param d display to open, path must be set
+ * @param open_mode O_RDONLY or O_RDWR
+ * @return false if the device cannot be opened, errno is set then
+ */
+bool open_display( Display& d, int open_mode ) {
+  if ( !( d.backend = open_backend( d.path, open_mode, d.fd )))
+    return false;
+  d.primed = false;
+
+  /* the backend accesses the underlying driver */
+  d.version = d.backend->version();
+
+  /* suck out some device information */
+  memset( &d.device_info, 0, sizeof( d.device_info ));
+  d.backend->devinfo( d.device_info );
+  return true;
+}
+
+/** Checks whether the HID device is a usb monitor 
+ * @param d opened display
+ */
+bool is_usb_monitor ( const Display& d ) {
+  for ( int appl_num = 0; appl_num < d.device_info.num_applications; 
+        ++appl_num ) {
+    /* Now that we have the number of applications, we can retrieve them */
+    /* using the HIDIOCAPPLICATION ioctl() call or what the backend has */
+    /* applications are indexed from 0..{num_applications-1} */
+    int application = d.backend->application( appl_num );
+    /* The magic values come from various usage table specs */
+    if ( ((application >> 16) & 0xFF) == 0x80 ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Prepares the brightness usage and report structures of the display */
+void apply_layout( Display& d, const Layout& layout ) {
+  d.layout = layout;
+
+  memset( &d.usage_ref, 0, sizeof( d.usage_ref ));
+  d.usage_ref.report_type = layout.report_type;
+  d.usage_ref.report_id = layout.report_id;
+  d.usage_ref.field_index = layout.field_index;
+  d.usage_ref.usage_index = layout.usage_index;
+  d.usage_ref.usage_code = layout.usage_code;
+
+  memset( &d.rep_info, 0, sizeof( d.rep_info ));
+  d.rep_info.report_type = layout.report_type;
+  d.rep_info.report_id = layout.report_id;
+  d.rep_info.num_fields = 1;
+}
+
+/** Usage maps walked in this session, by vendor, product and release. The
+ * reports are described by the model, so displays of the same model share
+ * the map and are walked only once. */
+struct ReportMap {
+  UsageMap usages;
+  Fields fields;
+};
+
+typedef map< uint64_t, ReportMap > UsageMaps;
+UsageMaps usage_maps;
+mutex usage_maps_lock;
+
+/** @return usages and fields of the display, its reports are walked on
+ *          first use */
+const ReportMap& report_map( const Display& d ) {
+  uint64_t key = (uint64_t)( d.device_info.vendor & 0xFFFF ) << 32 |
+    (uint64_t)( d.device_info.product & 0xFFFF ) << 16 |
+    ( d.device_info.version & 0xFFFF );
+  {
+    lock_guard< mutex > guard( usage_maps_lock );
+    UsageMaps::const_iterator it = usage_maps.find( key );
+    if ( it != usage_maps.end() )
+      return it->second;
+  }
+
+  ReportMap reports;
+  walk_reports( *d.backend, reports.usages, &reports.fields, 0 );
+  lock_guard< mutex > guard( usage_maps_lock );
+  return usage_maps.insert( UsageMaps::value_type( key, reports ))
+    .first->second;
+}
+
+/** @return location and range of the brightness control as described by
+ *          the reports of the display. What the display does not describe
+ *          is taken from our database. */
+Layout brightness_layout( const Display& d ) {
+  Layout layout = { HID_REPORT_TYPE_FEATURE, BRIGHTNESS_CONTROL, 0, 0,
+                    USAGE_CODE, 0, 255 };
+  const UsageMap& usages = report_map( d ).usages;
+  UsageMap::const_iterator it = usages.find( USAGE_CODE );
+  if ( it != usages.end() )
+    layout = it->second;
+
+  if ( it == usages.end() ||
+       layout.logical_maximum <= layout.logical_minimum ) {
+    layout.logical_minimum = d.device ? d.device->brightness_min : 0;
+    layout.logical_maximum = d.device ? d.device->brightness_max : 255;
+  }
+  return layout;
+}
+
+/** Checks that an opened device is a supported monitor and prepares the
+ * brightness usage and report structures.
+ * @param d opened display
+ * @param force accept devices which are not in our database
+ * @param err stream to report problems to
+ * @return 0 on success, -1 if the device should be skipped, exit code for
+ *         fatal failures
+ */
+int probe_display( Display& d, bool force, ostream& err ) {
+  if ( not (d.device = is_supported ( d.device_info )) ){
+    err << "Device unsupported:";
+    format_device( err, d.device_info );
+    if ( !force )
+      return 2;
+  }
+
+  if (! is_usb_monitor( d )) {
+    err << d.path << ": This device is NOT USB monitor!" << endl;
+    return -1;
+  }
+
+  /* Initialise the internal report structures */
+  if ( d.backend->init_report() < 0 ) {
+    err << "FATAL: Failed to initialize internal report structures"
+        << endl;
+    return 1;
+  }
+
+  apply_layout( d, brightness_layout( d ));
+  return 0;
+}
+
+/** @return message for the failure code of get_brightness()/set_brightness() */
+const char* io_failure( int code ) {
+  return code == 2 ? "Usage failed!" : "Report failed!";
+}
+
+/** @return quirks of the display. Nothing is known about displays which are
+ *          not in our database, so they get every workaround. */
+unsigned display_quirks( const Display& d ) {
+  return d.device ? d.device->quirks : QUIRKS_ALL;
+}
+
+/** @return smallest brightness change the display takes */
+int display_granularity( const Display& d ) {
+  return d.device && d.device->granularity > 1 ? d.device->granularity : 1;
+}
+
+/** Reads current brightness of the display. The report has to be fetched
+ * from the display before the usage is taken from it, otherwise the value
+ * of the previous report (zero after boot up) is returned.
+ * @param d probed display
+ * @param value receives the brightness
+ * @return 0 on success, 2 if the usage or 3 if the report ioctl failed
+ */
+int get_brightness( Display& d, int& value ) {
+  if ( d.backend->get_report( d.rep_info ) < 0 )
+    return 3;
+  d.primed = true;
+  if ( d.backend->get_usage( d.usage_ref ) < 0 )
+    return 2;
+  value = d.usage_ref.value;
+  return 0;
+}
+
+/** Writes brightness to the display
+ * @param d probed display
+ * @param value brightness to set
+ * @return 0 on success, 2 if the usage or 3 if the report ioctl failed
+ */
+int set_brightness( Display& d, int value ) {
+  /* the whole report is written, fill in what the display has first */
+  if ( !d.primed && ( display_quirks( d ) & QUIRK_PRIME_WRITE )) {
+    if ( d.backend->get_report( d.rep_info ) < 0 )
+      return 3;
+    d.primed = true;
+  }
+
+  d.usage_ref.value = value;
+  if ( d.backend->set_usage( d.usage_ref ) < 0 )
+    return 2;
+  if ( d.backend->set_report( d.rep_info ) < 0 )
+    return 3;
+  return 0;
+}
+
+/** @return whether the display may not take a value as written */
+bool needs_read_back( const Display& d ) {
+  return display_quirks( d ) & QUIRK_READBACK;
+}
+
+/** Reads the brightness back after a write
+ * @param value written brightness, replaced by the one read back
+ * @param verify VERIFY_SYNC always reads back, VERIFY_NONE never and
+ *        VERIFY_ASYNC only if the display may not take the value as written
+ * @return 0 on success, failure code of get_brightness() otherwise
+ */
+int read_back( Display& d, int& value, int verify ) {
+  if ( verify == VERIFY_NONE ||
+       ( verify == VERIFY_ASYNC && !needs_read_back( d )))
+    return 0;
+  if ( d.device && d.device->settle_ms )
+    usleep( d.device->settle_ms * 1000 );
+  return get_brightness( d, value );
+}
+
+/** Values of report fields, one entry per field */
+typedef vector< vector< int > > FieldValues;
+
+/** @return whether both fields belong to the same report */
+bool same_report( const Field& a, const Field& b ) {
+  return a.report_type == b.report_type && a.report_id == b.report_id;
+}
+
+/** Prepares a multi usage reference covering all usages of the field */
+/** @return number of values of the field, an array field has less of them
+ *          than usages and the kernel refuses to move more */
+size_t field_values( const Field& f ) {
+  return min( min( f.codes.size(), (size_t)f.report_count ),
+              (size_t)HID_MAX_MULTI_USAGES );
+}
+
+void field_ref( hiddev_usage_ref_multi& multi, const Field& f ) {
+  memset( &multi.uref, 0, sizeof( multi.uref ));
+  multi.uref.report_type = f.report_type;
+  multi.uref.report_id = f.report_id;
+  multi.uref.field_index = f.field_index;
+  multi.uref.usage_index = 0;
+  multi.num_values = field_values( f );
+}
+
+/** Transfers a whole report from or to the display
+ * @param get read the report rather than write it
+ */
+int transfer_report( Display& d, const Field& f, bool get ) {
+  hiddev_report_info rep_info;
+  memset( &rep_info, 0, sizeof( rep_info ));
+  rep_info.report_type = f.report_type;
+  rep_info.report_id = f.report_id;
+  return get ? d.backend->get_report( rep_info ) :
+    d.backend->set_report( rep_info );
+}
+
+/** Reads all usages of the fields. Each report is fetched from the display
+ * once, every field is then taken from it by a single get_usages().
+ * @param fields fields grouped by report
+ * @param values receives the values of the fields
+ * @return 0 on success, 2 if the usages or 3 if the report ioctl failed
+ */
+int get_fields( Display& d, const vector< const Field* >& fields,
+                FieldValues& values ) {
+  hiddev_usage_ref_multi multi;
+
+  values.assign( fields.size(), vector< int >() );
+  for ( size_t i = 0; i < fields.size(); ++i ) {
+    const Field& f = *fields[ i ];
+    if (( i == 0 || !same_report( f, *fields[ i - 1 ] )) &&
+        transfer_report( d, f, true ) < 0 )
+      return 3;
+
+    field_ref( multi, f );
+    if ( d.backend->get_usages( multi ) < 0 )
+      return 2;
+    values[ i ].assign( multi.values, multi.values + multi.num_values );
+  }
+  return 0;
+}
+
+/** Writes all usages of the fields. Every field is filled by a single
+ * set_usages() and each report sent to the display once.
+ * @param fields fields grouped by report, all fields of a report must be
+ *        given or the missing ones are sent as the kernel has them
+ * @param values values of the fields
+ * @return 0 on success, 2 if the usages or 3 if the report ioctl failed
+ */
+int set_fields( Display& d, const vector< const Field* >& fields,
+                const FieldValues& values ) {
+  hiddev_usage_ref_multi multi;
+
+  for ( size_t i = 0; i < fields.size(); ++i ) {
+    const Field& f = *fields[ i ];
+    field_ref( multi, f );
+    multi.num_values = min( (size_t)multi.num_values, values[ i ].size() );
+    copy( values[ i ].begin(), values[ i ].begin() + multi.num_values,
+          multi.values );
+    if ( d.backend->set_usages( multi ) < 0 )
+      return 2;
+
+    if (( i + 1 == fields.size() || !same_report( f, *fields[ i + 1 ] )) &&
+        transfer_report( d, f, false ) < 0 )
+      return 3;
+  }
+  return 0;
+}
+
+/** @return fields of the feature reports holding monitor controls (usage
+ *          page 0x82), brightness among them. Other fields of these
+ *          reports are included, as reports are transferred as a whole. */
+vector< const Field* > monitor_fields( const Fields& all ) {
+  vector< const Field* > fields;
+  for ( size_t i = 0; i < all.size(); ++i ) {
+    if ( all[ i ].report_type != HID_REPORT_TYPE_FEATURE )
+      continue;
+
+    bool controls = false;
+    for ( size_t j = 0; j < all.size() && !controls; ++j ) {
+      if ( !same_report( all[ i ], all[ j ] ))
+        continue;
+      for ( size_t u = 0; u < all[ j ].codes.size(); ++u )
+        controls = controls || ( all[ j ].codes[ u ] >> 16 ) == 0x82;
+    }
+    if ( controls )
+      fields.push_back( &all[ i ] );
+  }
+  return fields;
+}
+
+/** @return brightness limited to the range supported by the display */
+int clamp_brightness( const Display& d, int value ) {
+  return min( d.layout.logical_maximum,
+              max( d.layout.logical_minimum, value ));
+}
+
+/** @return brightness after changing it by amount. A change smaller than
+ *          the granularity of the display moves it by one step. */
+int change_target( const Display& d, int from, int amount ) {
+  int step = display_granularity( d );
+  if ( amount != 0 && abs( amount ) < step )
+    amount = amount > 0 ? step : -step;
+  return clamp_brightness( d, from + amount );
+}
+
+/** @return whether the display shows value at the same level as current,
+ *          so writing it would change nothing */
+bool same_brightness( const Display& d, int current, int value ) {
+  int step = display_granularity( d );
+  int lo = d.layout.logical_minimum;
+  return ( current - lo ) / step == ( value - lo ) / step;
+}
+
+/** Converts a brightness or amount given in percent of the range of the
+ * display
+ * @param percent brightness or amount in percent
+ * @param amount whether an amount rather than a brightness is converted
+ */
+int from_percent( const Display& d, int percent, bool amount ) {
+  int range = d.layout.logical_maximum - d.layout.logical_minimum;
+  int value = (int)lround( range * percent / 100.0 );
+  return amount ? value : clamp_brightness( d, d.layout.logical_minimum +
+                                            value );
+}
+
+/** Arms a one-shot timer
+ * @param fd timerfd
+ * @param ns timeout in nanoseconds
+ */
+void arm_timer( int fd, uint64_t ns ) {
+  itimerspec t;
+  memset( &t, 0, sizeof( t ));
+  /* zero would disarm the timer */
+  ns = max( ns, (uint64_t)1 );
+  t.it_value.tv_sec = ns / 1000000000ULL;
+  t.it_value.tv_nsec = ns % 1000000000ULL;
+  timerfd_settime( fd, 0, &t, 0 );
+}
+
+/** Starts a brightness ramp, or retargets a running one from its current
+ * position.
+ * @param d display
+ * @param from brightness the ramp starts at
+ * @param to target brightness
+ * @param ms ramp duration in milliseconds
+ * @param steps number of writes the ramp is split into, 0 for one per 20ms
+ */
+void start_fade( Display& d, int from, int to, int ms, int steps ) {
+  if ( steps <= 0 )
+    steps = max( 1, ms / 20 );
+
+  d.fading = true;
+  d.fade_from = d.fade_position = from;
+  d.fade_to = to;
+  d.fade_start = now_ns();
+  d.fade_ns = ms * 1000000ULL;
+  d.frame_ns = d.fade_ns / steps;
+}
+
+/** @return time until the next ramp step; a slow display gets fewer steps
+ *          rather than a queue of writes */
+uint64_t fade_interval( const Display& d ) {
+  uint64_t settle_ns = d.device ? d.device->settle_ms * 1000000ULL : 0;
+  return max( max( d.frame_ns, d.write_ns ), settle_ns );
+}
+
+/** Writes the brightness the ramp should have reached by now. The ramp ends
+ * once the target is written.
+ * @return 0 on success, failure code of set_brightness() otherwise
+ */
+int fade_step( Display& d ) {
+  uint64_t start = now_ns();
+  uint64_t elapsed = start - d.fade_start;
+  int value = d.fade_to;
+
+  if ( elapsed < d.fade_ns )
+    value = d.fade_from + (int)( (int64_t)( d.fade_to - d.fade_from ) *
+                                 (int64_t)elapsed / (int64_t)d.fade_ns );
+
+  if ( value != d.fade_position ) {
+    int rc = set_brightness( d, value );
+    if ( rc != 0 ) {
+      d.fading = false;
+      return rc;
+    }
+    uint64_t took = now_ns() - start;
+    d.write_ns = d.write_ns ? ( 3 * d.write_ns + took ) / 4 : took;
+    d.fade_position = value;
+  }
+
+  if ( value == d.fade_to )
+    d.fading = false;
+  return 0;
+}
+
+/** Ramps the brightness to the target, sleeping on a timerfd between steps
+ * @return 0 on success, failure code of set_brightness() otherwise
+ */
+int fade_brightness( Display& d, int from, int to, int ms, int steps ) {
+  int timer = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+  int rc = 0;
+
+  if ( timer >= 0 ) {
+    start_fade( d, from, to, ms, steps );
+    while ( d.fading && rc == 0 ) {
+      uint64_t expirations;
+      arm_timer( timer, fade_interval( d ));
+      if ( read( timer, &expirations, sizeof( expirations )) < 0 &&
+           errno != EINTR )
+        break;
+      rc = fade_step( d );
+    }
+    close( timer );
+  }
+
+  /* no timer, jump straight to the target */
+  if ( rc == 0 && ( timer < 0 || d.fading )) {
+    d.fading = false;
+    rc = set_brightness( d, to );
+  }
+  return rc;
+}
+
+/** Prints help for the program.
+ * @param programName this program name
+ */
+void help( const char *programName ) {
+  printf( "acdcontrol " VERSION "\n");
+
+  printf( "USAGE: %s [--silent|-s] [--brief|-b] [--verbose|-v] [--help|-h] [--about|-a] "
+          "[--detect|-d] [--dump] [--list-all |-l] [--device-db <file>] "
+          "[--compile-db <source>] [--save <file>] [--restore <file>] [--auto] "
+          "[--probe-timeout <ms>] [--sysfs-root <dir>] [--dev-root <dir>] "
+          "[--discovery-cache <file>] [--jobs <n>] [--watch] [--daemon] [--socket <path>] "
+          "[--coalesce <ms>] [--fade <ms>] [--steps <n>] "
+          "[--cache-ttl <ms>] [--verify=none|sync|async] [--force-write] "
+          "[--backend=hiddev|hidraw|usbfs|mock[:<spec>]|replay:<file>[,fast]] "
+          "[--record <file>] [--direct] "
+          "[<hid device(s)>] [<brightness>]\n\n"
+          "Parameters:\n"
+          "  --silent,-s\n"
+          "         Suppress non-functional program output\n"
+          "  --brief,-b\n"
+          "         Print brightness value only when in query mode,\n"
+          "         otherwise ignored.\n"
+          "  --verbose,-v\n"
+          "         Show the model names with --list-all.\n"
+          "  --detect, -d\n"
+          "         Perform detection only\n"
+          "  --dump\n"
+          "         Print all reports, fields and usages of the devices\n"
+          "         with their current values.\n"
+          "  --save <file>\n"
+          "         Save all monitor controls of the devices to <file>,\n"
+          "         - for standard output.\n"
+          "  --restore <file>\n"
+          "         Restore the monitor controls saved in <file>.\n"
+          "  --list-all, -l\n"
+          "         List supported devices and exit\n"
+          "  --device-db <file>\n"
+          "         Binary database of additional devices, default\n"
+          "         " DEFAULT_DEVICE_DB ", empty disables.\n"
+          "  --compile-db <source>\n"
+          "         Compile the text database <source> into the file given\n"
+          "         by --device-db and exit.\n"
+          "  --auto\n"
+          "         Find the displays connected to this host and use them.\n"
+          "  --probe-timeout <ms>\n"
+          "         Give up probing a device not answering within <ms>\n"
+          "         when looking for displays, default 1000.\n"
+          "  --discovery-cache <file>\n"
+          "         Remember probed displays in <file>, default\n"
+          "         " DEFAULT_DISCOVERY_CACHE ", empty disables.\n"
+          "  --sysfs-root <dir>\n"
+          "         Where sysfs is mounted, default /sys.\n"
+          "  --dev-root <dir>\n"
+          "         Where the device nodes are, default /dev.\n"
+          "  --jobs <n>\n"
+          "         Handle up to <n> devices at once, default all of them.\n"
+          "  --watch\n"
+          "         Print brightness whenever it changes, until terminated.\n"
+          "  --daemon\n"
+          "         Keep the devices open and serve brightness requests\n"
+          "         on a Unix domain socket until terminated.\n"
+          "  --socket <path>\n"
+          "         Socket of the daemon, default " DEFAULT_SOCKET "\n"
+          "  --coalesce <ms>\n"
+          "         Daemon merges relative changes arriving within <ms>\n"
+          "         after a write into a single write, default 50, 0 disables.\n"
+          "  --fade <ms>\n"
+          "         Ramp the brightness to the new value over <ms> milliseconds.\n"
+          "  --steps <n>\n"
+          "         Number of writes a ramp is split into, default one per 20ms.\n"
+          "  --cache-ttl <ms>\n"
+          "         Daemon answers queries from memory for <ms> after the\n"
+          "         brightness was read or written, default 10000, 0 disables.\n"
+          "  --verify=none|sync|async\n"
+          "         Read the brightness back after relative changes: always\n"
+          "         before answering (sync, default), never (none) or, in the\n"
+          "         daemon, after answering on displays which may not take the\n"
+          "         value as written (async).\n"
+          "  --force-write\n"
+          "         Write the brightness even if the display has it already.\n"
+          "  --backend=hiddev|hidraw|usbfs|mock[:<spec>]|replay:<file>[,fast]\n"
+          "         Kind of device nodes --auto and selectors look for,\n"
+          "         default hiddev unless the host has none. mock simulates\n"
+          "         displays mock0, mock1, ... as given by the comma separated\n"
+          "         <spec> keys model=<name>, displays=<n>, brightness=<n>,\n"
+          "         latency=<ms>, jitter=<ms>, distribution=uniform|normal|\n"
+          "         exponential, eio=<percent>, unplug-after=<n>,\n"
+          "         first-read-zero, no-descriptor, granularity=<n>, settle=<ms>\n"
+          "         and seed=<n>.\n"
+          "         replay serves the displays of a --record trace with the\n"
+          "         recorded timing or, with fast, no delays; operations other\n"
+          "         than recorded fail.\n"
+          "  --record <file>\n"
+          "         Write every device operation to the binary trace <file>.\n"
+          "  --direct\n"
+          "         Access the devices directly even if a daemon is running.\n"
+          "  --help,-h\n"
+          "         Show short help message and quit.\n"
+          "  --about,-a\n"
+          "         Show information about the program, some credits and thanks.\n"
+          "  hid device\n"
+          "         device that represents your Apple Cinema display.\n"
+          "         It shoud normally be one of /dev/usb/hiddevX. or /dev/hiddevX\n"
+          "         or, without hiddev, /dev/hidrawX. Without a HID driver\n"
+          "         the USB device /dev/bus/usb/BBB/DDD is used directly.\n"
+          "         Instead of the path, the device can be selected with\n"
+          "         serial:<serial number>, model:<model name> (see --list-all -v)\n"
+          "         or usbpath:<USB port> (e.g. usbpath:1-2.3).\n"
+          "      Note\n"
+          "         You must have write permissions to this device.\n"
+          "      Note\n"
+          "         It should be safe to run the program on other device than\n"
+          "         Apple Cinema/Studio Display as the program checks whether\n"
+          "         the device is Apple display and warns about it.\n"
+          "  brightness\n"
+          "         When this option is specified, the operation is to set brightness,\n"
+          "         otherwise, current brightness is retreived. If brightness starts\n"
+          "         with '+' or '-', the current brightness is increased or decreased\n"
+          "         by that value. With a trailing '%%' brightness or change are\n"
+          "         given in percent of the brightness range of each display.\n"
+          "      Note\n"
+          "         Preceed brightness decrement by '--'.\n"
+          "      See also: --brief option.\n"
+
+          "\n\nEXAMPLES:\n\n"
+          "In the following examples I assume that your HID device is /dev/hiddev0. You may \n"
+          "have it as /dev/hiddevX or /dev/usb/hiddevX.\n"
+          "\n"
+          "  acdcontrol\n"
+          "  acdcontrol --help\n"
+          "      Show long help message.\n"
+          "\n"
+          "  acdcontrol --detect /dev/hiddev*\n"
+          "      Perform detection, which HID device is actually your display to be controlled.\n"
+          "\n"
+          "  acdcontrol /dev/hiddev0\n"
+          "      Read current brightness parameter\n"
+          "\n"
+          "  acdcontrol /dev/hiddev0 160\n"
+          "      Set brightness to 160. Note, that brightness setting depends on your model. \n"
+          "      Generally, this parameter may get values in the range [0-255].\n"
+          "\n"
+          "  acdcontrol /dev/hiddev0 +10\n"
+          "      Increment current brightness by 10.\n"
+          "\n"
+          "  acdcontrol /dev/hiddev0 -- -10\n"
+          "      Decrement current brightness by 10. Please,note '--'!\n"
+          "\n"
+          "  acdcontrol /dev/hiddev0 50%%\n"
+          "      Set brightness to the middle of the range of the display.\n"
+          "\n"
+          "  acdcontrol --auto 160\n"
+          "      Set brightness of all connected displays to 160.\n"
+          ,
+
+      
+          programName );
+}
+
+/** Prints brief notice about the program */
+void notice() {
+  printf( "Apple Cinema and Studio Display Control Program. Please, use --about switch to learn more\n" );
+}
+
+/** Prints detailed info about this program */
+void about() {
+  printf( "acdcontrol " VERSION "\n");
+
+  printf( "Written by Pavel Gurevich.\n\n"
+          "This program is a free software and is distributed under GPL2\n\n"
+          "CREDITS\n\n"
+          "This program would never possibly come out without valuable help of Andre Beckedorf."
+          " Andre wrote a similar software for Windows. Please, visit http://metaexception.de/."
+          " Andre would like to thank to people that helped him to write his software and I'd "
+          "like to join him as they helped me that way :)\n\n"
+          "    * Dmitri Kitaynik (20\" Display)\n"
+          "    * Mark Wagner (15\" and 17\" Displays)\n" 
+          "    * Veit Wahlich (30\" Display)\n" 
+          "    * Charles Lepple (24\" Display)\n" 
+          "    * Arne Zellentin (relative brightness change)\n\n"
+          " Please, visit http://acdcontrol.sf.net for updates\n"
+          "NOTE: You can suppress a startup message with --silent (-s) option\n"
+          );
+}
+
+typedef list< const char* > FileList;
+
+/** Behavior options */
+struct Options {
+  bool brief;
+  bool silent;
+  bool verbose;
+  bool force;
+  bool percent;             // brightness or amount given in percent
+  const char* socket_path;
+  int coalesce_ms;
+  int fade_ms;              // -1 if not given
+  int steps;
+  int cache_ttl_ms;
+  int jobs;                 // 0 for one thread per device
+  bool auto_detect;
+  int probe_timeout_ms;
+  const char* sysfs_root;
+  const char* dev_root;           // where the device nodes are
+  const char* discovery_cache;    // empty to disable
+  const char* device_db;          // empty to disable
+  const char* state_file;         // for SAVE and RESTORE
+  bool force_write;               // write brightness the display has
+  int verify;                     // VERIFY_*, -1 if not given
+  int backend;                    // BACKEND_* to discover, -1 to pick
+  const char* backend_spec;       // of --backend=mock:<spec> or replay:<file>
+  const char* record_file;        // trace of --record, empty for none
+
+  Options()
+    : brief( false )
+    , silent( false )
+    , verbose( false )
+    , force( false )
+    , percent( false )
+    , socket_path( DEFAULT_SOCKET )
+    , coalesce_ms( 50 )
+    , fade_ms( -1 )
+    , steps( 0 )
+    , cache_ttl_ms( 10000 )
+    , jobs( 0 )
+    , auto_detect( false )
+    , probe_timeout_ms( 1000 )
+    , sysfs_root( "/sys" )
+    , dev_root( "/dev" )
+    , discovery_cache( DEFAULT_DISCOVERY_CACHE )
+    , device_db( DEFAULT_DEVICE_DB )
+    , state_file( "-" )
+    , force_write( false )
+    , verify( -1 )
+    , backend( -1 )
+    , backend_spec( "" )
+    , record_file( "" )
+    { }
+};
+
+/** @return verification policy, synchronous unless given otherwise */
+int verify_policy( const Options& options ) {
+  return options.verify < 0 ? VERIFY_SYNC : options.verify;
+}
+
+/** @return BACKEND_* for the backend name, -1 if it is unknown */
+int parse_backend( const char* name ) {
+  if ( strcmp( name, "mock" ) == 0 || strncmp( name, "mock:", 5 ) == 0 )
+    return BACKEND_MOCK;
+  if ( strncmp( name, "replay:", 7 ) == 0 )
+    return BACKEND_REPLAY;
+  for ( int b = BACKEND_HIDDEV; b <= BACKEND_USBFS; ++b )
+    if ( strcmp( name, BACKEND_NAMES[ b ] ) == 0 )
+      return b;
+  return -1;
+}
+
+/** @return VERIFY_* for the policy name, -1 if it is unknown */
+int parse_verify( const char* name ) {
+  for ( int v = VERIFY_NONE; v <= VERIFY_ASYNC; ++v )
+    if ( strcmp( name, VERIFY_NAMES[ v ] ) == 0 )
+      return v;
+  return -1;
+}
+
+volatile sig_atomic_t quit_requested = 0;
+
+void request_quit( int ) {
+  quit_requested = 1;
+}
+
+/** Lets SIGINT and SIGTERM interrupt blocking calls and end the main loop */
+void catch_quit_signals() {
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa ));
+  sa.sa_handler = request_quit;
+  sigaction( SIGINT, &sa, 0 );
+  sigaction( SIGTERM, &sa, 0 );
+}
+
+/** Prints brightness of the display the way query mode does */
+void print_brightness( ostream& o, const Display& d, int value,
+                       const Options& options ) {
+  if ( !options.brief )
+    o << d.path << ": BRIGHTNESS=";
+  o << value << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Discovery cache
+//
+// Displays probed once are recorded together with the USB port they are
+// plugged into. As long as sysfs shows the same device at the same port and
+// the system has not been rebooted, the recorded report layout is used and
+// the device is not probed again.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Display recorded in the discovery cache */
+struct CacheEntry {
+  string node;
+  string usbpath;           // USB port, e.g. 1-2.3
+  Vendor vendor;
+  Product product;
+  Layout layout;
+};
+
+typedef map< string, CacheEntry > DiscoveryCache;   // by device node
+DiscoveryCache discovery_cache;
+mutex discovery_cache_lock;
+bool discovery_cache_dirty = false;
+
+/** Reads a hexadecimal sysfs attribute
+ * @return false if the attribute cannot be read
+ */
+bool read_sysfs_hex( const string& path, unsigned& value ) {
+  FILE* f = fopen( path.c_str(), "r" );
+  if ( !f )
+    return false;
+  bool ok = fscanf( f, "%x", &value ) == 1;
+  fclose( f );
+  return ok;
+}
+
+/** @return sysfs class directory of the nodes of the backend */
+string sysfs_class( const string& sysfs_root, int backend ) {
+  return sysfs_root + ( backend == BACKEND_HIDRAW ? "/class/hidraw" :
+                        "/class/usbmisc" );
+}
+
+/** @return sysfs directory of the USB device behind a hiddev or hidraw node */
+string usb_device_dir( const string& sysfs_root, const string& name ) {
+  /* device of a hiddev node is the USB interface, the one of a hidraw node
+   * the HID device on top of it */
+  if ( name.compare( 0, 6, "hidraw" ) == 0 )
+    return sysfs_class( sysfs_root, BACKEND_HIDRAW ) + "/" + name +
+      "/device/../..";
+  return sysfs_class( sysfs_root, BACKEND_HIDDEV ) + "/" + name +
+    "/device/..";
+}
+
+/** @return contents of a sysfs attribute without the trailing newline */
+string read_sysfs_string( const string& path ) {
+  char value[ 256 ] = "";
+  FILE* f = fopen( path.c_str(), "r" );
+  if ( f ) {
+    if ( !fgets( value, sizeof( value ), f ))
+      value[ 0 ] = 0;
+    fclose( f );
+  }
+  value[ strcspn( value, "\n" ) ] = 0;
+  return value;
+}
+
+/** Looks up the USB device behind a hiddev or hidraw node in sysfs
+ * @param sysfs_root sysfs mount point
+ * @param name node name, e.g. hiddev0
+ * @param usbpath receives the USB port of the device
+ * @return false if sysfs does not know the node
+ */
+bool usb_identity( const string& sysfs_root, const string& name,
+                   string& usbpath, Vendor& vendor, Product& product ) {
+  string usb = usb_device_dir( sysfs_root, name );
+  char resolved[ PATH_MAX ];
+
+  if ( !read_sysfs_hex( usb + "/idVendor", vendor ) ||
+       !read_sysfs_hex( usb + "/idProduct", product ) ||
+       !realpath( usb.c_str(), resolved ))
+    return false;
+
+  usbpath = strrchr( resolved, '/' ) + 1;
+  return true;
+}
+
+/** @return name of the device node without directories */
+string node_name( const string& node ) {
+  return node.substr( node.rfind( '/' ) + 1 );
+}
+
+/** @return identifier of the running boot */
+string boot_id() {
+  char id[ 64 ] = "";
+  FILE* f = fopen( "/proc/sys/kernel/random/boot_id", "r" );
+  if ( f ) {
+    if ( !fgets( id, sizeof( id ), f ))
+      id[ 0 ] = 0;
+    fclose( f );
+  }
+  id[ strcspn( id, "\n" ) ] = 0;
+  return id;
+}
+
+/** Loads the discovery cache unless it was written before the last boot */
+void load_discovery_cache( const Options& options ) {
+  if ( !*options.discovery_cache )
+    return;
+
+  FILE* f = fopen( options.discovery_cache, "r" );
+  if ( !f )
+    return;
+
+  char line[ PATH_MAX + 256 ];
+  char node[ PATH_MAX ], usbpath[ 64 ];
+  bool current = false;
+  CacheEntry e;
+
+  while ( fgets( line, sizeof( line ), f )) {
+    if ( strncmp( line, "boot ", 5 ) == 0 ) {
+      line[ strcspn( line, "\n" ) ] = 0;
+      current = boot_id() == line + 5;
+    } else if ( current &&
+                sscanf( line, "%s %63s %x %x %u %u %u %u %x %d %d", node,
+                        usbpath, &e.vendor, &e.product, &e.layout.report_type,
+                        &e.layout.report_id, &e.layout.field_index,
+                        &e.layout.usage_index, &e.layout.usage_code,
+                        &e.layout.logical_minimum,
+                        &e.layout.logical_maximum ) == 11 ) {
+      e.node = node;
+      e.usbpath = usbpath;
+      discovery_cache[ e.node ] = e;
+    }
+  }
+  fclose( f );
+}
+
+/** Writes the discovery cache if displays were probed */
+void save_discovery_cache( const Options& options ) {
+  lock_guard< mutex > guard( discovery_cache_lock );
+  if ( !discovery_cache_dirty || !*options.discovery_cache )
+    return;
+
+  string path = options.discovery_cache;
+  mkdir( path.substr( 0, path.rfind( '/' )).c_str(), 0755 );
+
+  /* a file of its own, so processes saving at the same time do not write
+   * into each other's; not being able to write the cache only costs time */
+  string tmp = path + ".XXXXXX";
+  int fd = mkstemp( &tmp[ 0 ] );
+  if ( fd < 0 )
+    return;
+  fchmod( fd, 0644 );
+  FILE* f = fdopen( fd, "w" );
+  if ( !f ) {
+    close( fd );
+    unlink( tmp.c_str() );
+    return;
+  }
+
+  fprintf( f, "# acdcontrol discovery cache\nboot %s\n", boot_id().c_str() );
+  for ( DiscoveryCache::iterator it = discovery_cache.begin();
+        it != discovery_cache.end(); ++it ) {
+    const CacheEntry& e = it->second;
+    fprintf( f, "%s %s %04x %04x %u %u %u %u %#x %d %d\n", e.node.c_str(),
+             e.usbpath.c_str(), e.vendor, e.product, e.layout.report_type,
+             e.layout.report_id, e.layout.field_index, e.layout.usage_index,
+             e.layout.usage_code, e.layout.logical_minimum,
+             e.layout.logical_maximum );
+  }
+  if ( fclose( f ) == 0 && rename( tmp.c_str(), path.c_str() ) == 0 )
+    discovery_cache_dirty = false;
+  else
+    unlink( tmp.c_str() );
+}
+
+/** Looks the node up in the discovery cache
+ * @param entry receives the cache entry
+ * @return false unless the node is cached and sysfs still shows the same
+ *         device at the same USB port
+ */
+bool cached_display( const Options& options, const string& node,
+                     CacheEntry& entry ) {
+  {
+    lock_guard< mutex > guard( discovery_cache_lock );
+    DiscoveryCache::iterator it = discovery_cache.find( node );
+    if ( it == discovery_cache.end() )
+      return false;
+    entry = it->second;
+  }
+
+  string usbpath;
+  Vendor vendor;
+  Product product;
+  return usb_identity( options.sysfs_root, node_name( node ), usbpath,
+                       vendor, product ) &&
+    usbpath == entry.usbpath && vendor == entry.vendor &&
+    product == entry.product;
+}
+
+/** Records a freshly probed display in the discovery cache */
+void cache_display( const Options& options, const Display& d ) {
+  CacheEntry e;
+  if ( !usb_identity( options.sysfs_root, node_name( d.path ), e.usbpath,
+                      e.vendor, e.product ))
+    return;
+
+  e.node = d.path;
+  e.layout = d.layout;
+  lock_guard< mutex > guard( discovery_cache_lock );
+  discovery_cache[ e.node ] = e;
+  discovery_cache_dirty = true;
+}
+
+/** Prepares an opened display for brightness control. A display found in
+ * the discovery cache is used right away, others are probed.
+ * @return 0 on success, see probe_display() otherwise
+ */
+int prepare_display( Display& d, const Options& options, ostream& err ) {
+  CacheEntry e;
+  Vendor vendor = d.device_info.vendor & 0xFFFF;
+  Product product = d.device_info.product & 0xFFFF;
+
+  if ( cached_display( options, d.path, e ) && e.vendor == vendor &&
+       e.product == product && ( d.device = is_supported( d.device_info ))) {
+    apply_layout( d, e.layout );
+    return 0;
+  }
+
+  int rc = probe_display( d, options.force, err );
+  if ( rc == 0 && d.device )
+    cache_display( options, d );
+  return rc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Display discovery
+//
+// hidraw nodes are looked at instead on hosts without hiddev, or if asked to,
+// and usbfs nodes if asked to.
+// Vendor and product of every node are looked up in sysfs first, so
+// only devices from our database are opened at all. Without sysfs all nodes
+// are candidates.
+//
+// Candidates found in the discovery cache are taken as they are, the others
+// are probed by a pool of up to --jobs (by default 8) threads. Nodes which do
+// not answer within the probe timeout are given up, so a hanging device costs
+// no more than the timeout however many HID devices the host has. Threads
+// stuck in such a device are left behind, and the program then ends without
+// running destructors they could trip over.
+////////////////////////////////////////////////////////////////////////////////
+
+/** @return hiddev nodes present on this host
+ * @param dev directory of the device nodes */
+vector< string > hiddev_nodes( const string& dev ) {
+  vector< string > nodes;
+  glob_t g;
+
+  memset( &g, 0, sizeof( g ));
+  glob( ( dev + "/usb/hiddev*" ).c_str(), 0, 0, &g );
+  glob( ( dev + "/hiddev*" ).c_str(), GLOB_APPEND, 0, &g );
+  for ( size_t i = 0; i < g.gl_pathc; ++i )
+    nodes.push_back( g.gl_pathv[ i ] );
+  globfree( &g );
+  return nodes;
+}
+
+/** @return hidraw nodes present on this host */
+vector< string > hidraw_nodes( const string& dev ) {
+  vector< string > nodes;
+  glob_t g;
+
+  memset( &g, 0, sizeof( g ));
+  glob( ( dev + "/hidraw*" ).c_str(), 0, 0, &g );
+  for ( size_t i = 0; i < g.gl_pathc; ++i )
+    nodes.push_back( g.gl_pathv[ i ] );
+  globfree( &g );
+  return nodes;
+}
+
+/** @return usbfs nodes present on this host, one per USB device */
+vector< string > usbfs_nodes( const string& dev ) {
+  vector< string > nodes;
+  glob_t g;
+
+  memset( &g, 0, sizeof( g ));
+  glob( ( dev + "/bus/usb/*/*" ).c_str(), 0, 0, &g );
+  for ( size_t i = 0; i < g.gl_pathc; ++i )
+    nodes.push_back( g.gl_pathv[ i ] );
+  globfree( &g );
+  return nodes;
+}
+
+/** @return names of the mock displays */
+vector< string > mock_nodes() {
+  vector< string > nodes;
+  for ( unsigned i = 0; i < mock_spec.displays; ++i )
+    nodes.push_back( "mock" + to_string( i ));
+  return nodes;
+}
+
+/** @return backend whose nodes are discovered, hiddev unless asked otherwise
+ *          or the host has no hiddev nodes */
+int discovery_backend( const Options& options ) {
+  if ( options.backend >= 0 )
+    return options.backend;
+  return hiddev_nodes( options.dev_root ).empty() ? BACKEND_HIDRAW :
+    BACKEND_HIDDEV;
+}
+
+/** @return nodes of the discovered backend present on this host */
+vector< string > device_nodes( const Options& options ) {
+  switch ( discovery_backend( options )) {
+  case BACKEND_HIDRAW: return hidraw_nodes( options.dev_root );
+  case BACKEND_USBFS:  return usbfs_nodes( options.dev_root );
+  case BACKEND_MOCK:   return mock_nodes();
+  case BACKEND_REPLAY: return replay_trace.paths;
+  }
+  return hiddev_nodes( options.dev_root );
+}
+
+/** @return whether node a sorts before node b, hiddev2 before hiddev10 */
+bool node_order( const string& a, const string& b ) {
+  return a.size() < b.size() || ( a.size() == b.size() && a < b );
+}
+
+/** USB device behind a device node as sysfs shows it */
+struct SysfsNode {
+  string node;
+  string usbpath;
+  string serial;
+  Vendor vendor;
+  Product product;
+};
+
+/** Lists the usbfs nodes of all USB devices, which sysfs shows on the bus
+ * rather than in a class
+ * @return false if there is no sysfs to look at
+ */
+bool sysfs_usb_devices( const string& root, const string& dev,
+                        vector< SysfsNode >& nodes ) {
+  string devices = root + "/bus/usb/devices";
+  DIR* dir = opendir( devices.c_str() );
+  if ( !dir )
+    return false;
+
+  while ( dirent* entry = readdir( dir )) {
+    /* interfaces are listed as <port>:<configuration>.<interface> */
+    string name = entry->d_name;
+    string usb = devices + "/" + name;
+    SysfsNode n;
+    if ( name[ 0 ] == '.' || name.find( ':' ) != string::npos ||
+         !read_sysfs_hex( usb + "/idVendor", n.vendor ) ||
+         !read_sysfs_hex( usb + "/idProduct", n.product ))
+      continue;
+
+    char node[ 32 ];
+    snprintf( node, sizeof( node ), "/bus/usb/%03d/%03d",
+              atoi( read_sysfs_string( usb + "/busnum" ).c_str() ),
+              atoi( read_sysfs_string( usb + "/devnum" ).c_str() ));
+    n.node = dev + node;
+    n.usbpath = name;
+    n.serial = read_sysfs_string( usb + "/serial" );
+    nodes.push_back( n );
+  }
+  closedir( dir );
+  return true;
+}
+
+/** Lists the nodes of the backend with the USB devices behind them, without
+ * opening any device
+ * @param root sysfs mount point
+ * @param dev directory of the device nodes
+ * @param backend BACKEND_* of the nodes
+ * @return false if there is no sysfs to look at
+ */
+bool sysfs_nodes( const string& root, const string& dev, int backend,
+                  vector< SysfsNode >& nodes ) {
+  if ( backend >= BACKEND_MOCK )
+    return false;
+  if ( backend == BACKEND_USBFS )
+    return sysfs_usb_devices( root, dev, nodes );
+
+  string dir_name = sysfs_class( root, backend );
+  DIR* dir = opendir( dir_name.c_str() );
+  if ( !dir )
+    return false;
+
+  while ( dirent* entry = readdir( dir )) {
+    string name = entry->d_name;
+    SysfsNode n;
+    if ( name.compare( 0, 6, BACKEND_NAMES[ backend ] ) != 0 ||
+         !usb_identity( root, name, n.usbpath, n.vendor, n.product ))
+      continue;
+
+    n.node = dev + "/usb/" + name;
+    if ( access( n.node.c_str(), F_OK ) < 0 )
+      n.node = dev + "/" + name;
+    n.serial = read_sysfs_string( usb_device_dir( root, name ) + "/serial" );
+    nodes.push_back( n );
+  }
+  closedir( dir );
+  return true;
+}
+
+/** Lists nodes of supported devices without opening any device
+ * @param root sysfs mount point
+ * @param dev directory of the device nodes
+ * @param backend BACKEND_* of the nodes
+ * @param nodes receives the device nodes
+ * @return false if there is no sysfs to look at
+ */
+bool sysfs_supported_nodes( const string& root, const string& dev,
+                            int backend, vector< string >& nodes ) {
+  vector< SysfsNode > all;
+  if ( !sysfs_nodes( root, dev, backend, all ))
+    return false;
+
+  for ( size_t i = 0; i < all.size(); ++i )
+    if ( find_device( all[ i ].vendor, all[ i ].product ) &&
+         access( all[ i ].node.c_str(), F_OK ) == 0 )
+      nodes.push_back( all[ i ].node );
+
+  sort( nodes.begin(), nodes.end(), node_order );
+  return true;
+}
+
+/** Probe results shared with the probing threads, which may outlive the
+ * discovery when they time out */
+struct Discovery {
+  mutex lock;
+  condition_variable done;    // a probe started or finished
+  vector< string > nodes;
+  vector< size_t > todo;      // indices of the nodes to probe
+  size_t next;                // in todo, taken by the next free thread
+  size_t pending;             // nodes neither probed nor timed out
+  bool abandoned;             // discovery is over, take no more nodes
+  vector< char > found;       // by node
+  vector< char > probing;     // by node
+  vector< char > timed_out;   // by node
+  vector< chrono::steady_clock::time_point > deadline;  // by node
+  vector< char > finished;    // by thread
+
+  Discovery() : next( 0 ), pending( 0 ), abandoned( false ) { }
+};
+
+/** Most nodes probed at once unless --jobs says otherwise */
+const size_t PROBE_THREADS = 8;
+
+/** Probe threads running, some may be stuck in a device discovery gave up on */
+atomic< int > running_probes( 0 );
+
+/** Ends the program. Probe threads stuck in a device must not run into the
+ * globals destroyed by exit(), so the process ends without destructors if
+ * there are any.
+ */
+[[noreturn]] void finish( int status ) {
+  if ( running_probes > 0 ) {
+    cout << flush;
+    cerr << flush;
+    fflush( 0 );
+    _exit( status );
+  }
+  exit( status );
+}
+
+/** Checks whether the node is a display we are looking for
+ * @param supported_only skip monitors which are not in our database
+ */
+bool probe_node( const string& path, bool supported_only ) {
+  Display d( path );
+  bool monitor = false;
+
+  if ( open_display( d, O_RDONLY )) {
+    if ( !supported_only || is_supported( d.device_info ))
+      monitor = is_usb_monitor( d );
+    close_display( d );
+  }
+  return monitor;
+}
+
+/** Probes queued nodes until there are none left. A thread whose probe timed
+ * out leaves the queue to the thread started in its place.
+ * @param worker index of the thread
+ * @param timeout_ms of each probe
+ */
+void probe_nodes( shared_ptr< Discovery > discovery, size_t worker,
+                  bool supported_only, int timeout_ms ) {
+  unique_lock< mutex > guard( discovery->lock );
+  while ( !discovery->abandoned &&
+          discovery->next < discovery->todo.size() ) {
+    size_t i = discovery->todo[ discovery->next++ ];
+    string path = discovery->nodes[ i ];
+    discovery->probing[ i ] = true;
+    discovery->deadline[ i ] = chrono::steady_clock::now() +
+      chrono::milliseconds( timeout_ms );
+    discovery->done.notify_one();
+    guard.unlock();
+    bool monitor = probe_node( path, supported_only );
+    guard.lock();
+    discovery->probing[ i ] = false;
+    if ( discovery->timed_out[ i ] )
+      break;
+    discovery->found[ i ] = monitor;
+    --discovery->pending;
+    discovery->done.notify_one();
+  }
+  discovery->finished[ worker ] = true;
+  --running_probes;
+}
+
+/** Starts a probe thread, call with the lock of the discovery held */
+void start_probe( shared_ptr< Discovery > discovery, vector< thread >& probes,
+                  bool supported_only, int timeout_ms ) {
+  ++running_probes;
+  discovery->finished.push_back( false );
+  probes.push_back( thread( probe_nodes, discovery, probes.size(),
+                            supported_only, timeout_ms ));
+}
+
+/** Finds the displays connected to this host
+ * @param supported_only skip monitors which are not in our database
+ * @return device nodes of the displays
+ */
+vector< string > discover_displays( bool supported_only,
+                                    const Options& options ) {
+  vector< string > nodes;
+  int backend = discovery_backend( options );
+  if ( !supported_only ||
+       !sysfs_supported_nodes( options.sysfs_root, options.dev_root, backend,
+                               nodes ))
+    nodes = device_nodes( options );
+  shared_ptr< Discovery > discovery( new Discovery );
+
+  discovery->nodes = nodes;
+  discovery->found.resize( nodes.size() );
+  for ( size_t i = 0; i < nodes.size(); ++i ) {
+    CacheEntry e;
+    if ( supported_only && cached_display( options, nodes[ i ], e ))
+      discovery->found[ i ] = true;
+    else
+      discovery->todo.push_back( i );
+  }
+  discovery->pending = discovery->todo.size();
+  discovery->probing.resize( nodes.size() );
+  discovery->timed_out.resize( nodes.size() );
+  discovery->deadline.resize( nodes.size() );
+
+  /* a bounded pool takes the nodes one after another, each probe has a
+   * deadline of its own */
+  int timeout_ms = options.probe_timeout_ms;
+  vector< thread > probes;
+  unique_lock< mutex > guard( discovery->lock );
+  size_t count = min( discovery->todo.size(),
+                      options.jobs > 0 ? options.jobs : PROBE_THREADS );
+  for ( size_t t = 0; t < count; ++t )
+    start_probe( discovery, probes, supported_only, timeout_ms );
+
+  while ( discovery->pending > 0 ) {
+    chrono::steady_clock::time_point first =
+      chrono::steady_clock::time_point::max();
+    for ( size_t i = 0; i < nodes.size(); ++i )
+      if ( discovery->probing[ i ] && !discovery->timed_out[ i ] )
+        first = min( first, discovery->deadline[ i ] );
+    if ( first == chrono::steady_clock::time_point::max() )
+      discovery->done.wait( guard );
+    else
+      discovery->done.wait_until( guard, first );
+
+    /* a thread stuck in a hanging device is replaced by a fresh one */
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    for ( size_t i = 0; i < nodes.size(); ++i ) {
+      if ( !discovery->probing[ i ] || discovery->timed_out[ i ] ||
+           discovery->deadline[ i ] > now )
+        continue;
+      discovery->timed_out[ i ] = true;
+      --discovery->pending;
+      if ( discovery->next < discovery->todo.size() )
+        start_probe( discovery, probes, supported_only, timeout_ms );
+    }
+  }
+  discovery->abandoned = true;
+  vector< char > finished = discovery->finished;
+  guard.unlock();
+
+  /* threads stuck in a hanging device are left behind, finish() copes */
+  for ( size_t t = 0; t < probes.size(); ++t ) {
+    if ( finished[ t ] )
+      probes[ t ].join();
+    else
+      probes[ t ].detach();
+  }
+
+  guard.lock();
+  for ( size_t i = 0; i < nodes.size(); ++i )
+    if ( discovery->timed_out[ i ] )
+      cerr << nodes[ i ] << ": no answer within " << timeout_ms
+           << " ms, skipped" << endl;
+  vector< string > displays;
+  for ( size_t i = 0; i < nodes.size(); ++i ) {
+    if ( discovery->found[ i ] )
+      displays.push_back( nodes[ i ] );
+  }
+  return displays;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Device selectors
+//
+// hiddev numbers change across reboots and replugs, so devices can also be
+// selected by what they are or where they are plugged in:
+//
+//   serial:<serial number>   model:<model name>   usbpath:<USB port>
+//
+// All selectors of an invocation are resolved against a single enumeration
+// of the device nodes.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Selector -> device nodes it selects */
+typedef map< string, vector< string > > SelectorIndex;
+
+/** @return whether the argument is a device selector rather than a path */
+bool is_selector( const char* arg ) {
+  return strncmp( arg, "serial:", 7 ) == 0 ||
+    strncmp( arg, "model:", 6 ) == 0 ||
+    strncmp( arg, "usbpath:", 8 ) == 0;
+}
+
+/** Adds a model selector for the device to the index */
+void index_model( SelectorIndex& index, const string& node, Vendor vendor,
+                  Product product ) {
+  const DeviceId* device = find_device( vendor, product );
+  if ( device )
+    index[ string( "model:" ) + device->name ].push_back( node );
+}
+
+/** Indexes the nodes by all selectors using sysfs
+ * @return false if there is no sysfs to look at
+ */
+bool index_sysfs( const Options& options, SelectorIndex& index ) {
+  vector< SysfsNode > nodes;
+  if ( !sysfs_nodes( options.sysfs_root, options.dev_root,
+                     discovery_backend( options ),
+                     nodes ))
+    return false;
+
+  for ( size_t i = 0; i < nodes.size(); ++i ) {
+    const SysfsNode& n = nodes[ i ];
+    if ( !n.serial.empty() )
+      index[ "serial:" + n.serial ].push_back( n.node );
+    index[ "usbpath:" + n.usbpath ].push_back( n.node );
+    index_model( index, n.node, n.vendor, n.product );
+  }
+  return true;
+}
+
+/** Indexes the nodes by opening them, for hosts without sysfs. The USB port
+ * is not known then, the serial number only if the device reports it as
+ * string descriptor 3 as most devices do.
+ */
+void index_nodes( const Options& options, SelectorIndex& index ) {
+  vector< string > nodes = device_nodes( options );
+
+  for ( size_t i = 0; i < nodes.size(); ++i ) {
+    Display d( nodes[ i ] );
+    if ( !open_display( d, O_RDONLY ))
+      continue;
+
+    string serial = d.backend->serial();
+    if ( !serial.empty() )
+      index[ "serial:" + serial ].push_back( d.path );
+    index_model( index, d.path, d.device_info.vendor & 0xFFFF,
+                 d.device_info.product & 0xFFFF );
+    close_display( d );
+  }
+}
+
+/** Replaces device selectors by the nodes they select
+ * @param files devices given on the command line
+ * @param storage keeps the resolved node names
+ * @return false if a selector did not match any device
+ */
+bool resolve_selectors( FileList& files, list< string >& storage,
+                        const Options& options ) {
+  SelectorIndex index;
+  bool indexed = false;
+  bool ok = true;
+
+  for ( FileList::iterator it = files.begin(); it != files.end(); ) {
+    if ( !is_selector( *it )) {
+      ++it;
+      continue;
+    }
+
+    if ( !indexed ) {
+      if ( !index_sysfs( options, index ))
+        index_nodes( options, index );
+      for ( SelectorIndex::iterator i = index.begin(); i != index.end(); ++i )
+        sort( i->second.begin(), i->second.end(), node_order );
+      indexed = true;
+    }
+
+    SelectorIndex::iterator match = index.find( *it );
+    if ( match == index.end() ) {
+      cerr << *it << ": No such display" << endl;
+      ok = false;
+    } else {
+      for ( size_t i = 0; i < match->second.size(); ++i ) {
+        storage.push_back( match->second[ i ] );
+        files.insert( it, storage.back().c_str() );
+      }
+    }
+    it = files.erase( it );
+  }
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Daemon mode
+//
+// The daemon probes every display once and keeps the descriptors open, so a
+// request costs only the brightness ioctls. Clients send one request per line
+// over a Unix domain socket:
+//
+//   GET [<device>...]
+//   SET <brightness> [fade=<ms>] [steps=<n>] [force] [<device>...]
+//   SETREL <amount> [fade=<ms>] [steps=<n>] [verify=<policy>] [force]
+//          [<device>...]
+//   STATS
+//
+// Brightness and amount followed by '%' are percentages of the range of each
+// display. STATS answers with the number of writes verified after the reply
+// (verify=async) and how many of them the display did not take as written:
+//
+//   = verified <n>
+//   = mismatches <n>
+//
+// Without devices the request applies to all displays. The reply holds one
+// line per display and ends with a line containing a single dot:
+//
+//   = <device> <brightness>      current (or newly set) brightness
+//   ! <device> <message>         operation failed
+//   ? <device>                   device is not managed by the daemon
+//
+// Relative changes arriving within the coalescing window after a write are
+// merged and written once when the window expires. With a fade the change is
+// ramped by a timer instead. In both cases the reply carries the brightness
+// the display is going to have.
+//
+// Brightness written or read is cached, so queries are answered without a
+// round trip to the display until the cache expires or the display reports
+// an event. Writes of the brightness the display has already are skipped
+// unless the request says force.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef list< Display > Displays;
+
+/** State of the running daemon */
+struct Daemon {
+  Options options;
+  Displays displays;
+  int epoll_fd;
+  map< int, Display* > timers;   // coalescing, fade or verify timer ->
+                                 // display
+  map< int, Display* > devices;  // device descriptor -> display
+  unsigned long verified;        // writes read back by VERIFY_ASYNC
+  unsigned long mismatches;      // of them, not taken as written
+
+  Daemon( const Options& options_ )
+    : options( options_ )
+    , epoll_fd( -1 )
+    , verified( 0 )
+    , mismatches( 0 )
+    { }
+};
+
+/** Fills the socket address for the given path
+ * @return false if the path does not fit into the address
+ */
+bool socket_address( sockaddr_un& addr, const char* path ) {
+  memset( &addr, 0, sizeof( addr ));
+  addr.sun_family = AF_UNIX;
+  if ( strlen( path ) >= sizeof( addr.sun_path )) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy( addr.sun_path, path );
+  return true;
+}
+
+/** Creates the listening socket, replacing a stale one left by a dead daemon
+ * @param path socket path
+ * @return socket descriptor or -1 with errno set
+ */
+int daemon_listen( const char* path ) {
+  sockaddr_un addr;
+  if ( !socket_address( addr, path ))
+    return -1;
+
+  /* refuse to steal the socket of a running daemon */
+  int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( fd < 0 )
+    return -1;
+  if ( connect( fd, (sockaddr*)&addr, sizeof( addr )) == 0 ) {
+    close( fd );
+    errno = EADDRINUSE;
+    return -1;
+  }
+  if ( errno == ECONNREFUSED )
+    unlink( path );
+  close( fd );
+
+  if (( fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 )) < 0 )
+    return -1;
+  if ( bind( fd, (sockaddr*)&addr, sizeof( addr )) < 0 ||
+       listen( fd, 16 ) < 0 ) {
+    int error = errno;
+    close( fd );
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+/** @return whether the request selector denotes the display */
+bool selects( const Display& d, const string& selector ) {
+  if ( d.path == selector )
+    return true;
+
+  char a[ PATH_MAX ], b[ PATH_MAX ];
+  return realpath( d.path.c_str(), a ) && realpath( selector.c_str(), b ) &&
+    strcmp( a, b ) == 0;
+}
+
+/** Creates a timer of the display watched by the daemon
+ * @param timer receives the timerfd, left alone if it exists already
+ * @return false if no timer could be created
+ */
+bool daemon_add_timer( Daemon& daemon, Display& d, int& timer ) {
+  if ( timer >= 0 )
+    return true;
+  if (( timer = timerfd_create( CLOCK_MONOTONIC,
+                                TFD_CLOEXEC | TFD_NONBLOCK )) < 0 )
+    return false;
+
+  epoll_event ev;
+  memset( &ev, 0, sizeof( ev ));
+  ev.events = EPOLLIN;
+  ev.data.fd = timer;
+  epoll_ctl( daemon.epoll_fd, EPOLL_CTL_ADD, timer, &ev );
+  daemon.timers[ timer ] = &d;
+  return true;
+}
+
+/** Opens the coalescing window of the display after a relative change */
+void start_coalescing( Daemon& daemon, Display& d ) {
+  if ( !daemon_add_timer( daemon, d, d.coalesce_fd ))
+    return;
+
+  d.coalescing = true;
+  d.pending = false;
+  arm_timer( d.coalesce_fd, daemon.options.coalesce_ms * 1000000ULL );
+}
+
+/** Verifies a relative change as the policy says. VERIFY_ASYNC reads the
+ * brightness of displays which need it back once the display settled, after
+ * the reply was sent.
+ * @param value written brightness, replaced by the one read back
+ * @return 0 on success, failure code of get_brightness() otherwise
+ */
+int daemon_read_back( Daemon& daemon, Display& d, int& value, int verify ) {
+  if ( verify == VERIFY_ASYNC && needs_read_back( d ) &&
+       daemon_add_timer( daemon, d, d.verify_fd )) {
+    d.verify_expected = value;
+    arm_timer( d.verify_fd, d.device ? d.device->settle_ms * 1000000ULL : 0 );
+    return 0;
+  }
+  return read_back( d, value, verify );
+}
+
+/** Remembers the brightness the display has now */
+void remember( Display& d, int value ) {
+  d.cached = true;
+  d.cached_value = value;
+  d.cached_at = now_ns();
+}
+
+/** Writes relative changes merged so far to the display and remembers the
+ * brightness written, or the one read back
+ * @return 0 on success, failure code of set_brightness()/get_brightness()
+ */
+int flush_coalesced( Daemon& daemon, Display& d ) {
+  if ( !d.pending )
+    return 0;
+
+  d.pending = false;
+  if ( !daemon.options.force_write && d.cached &&
+       same_brightness( d, d.cached_value, d.target ))
+    return 0;
+
+  int rc = set_brightness( d, d.target );
+  if ( rc == 0 )
+    rc = daemon_read_back( daemon, d, d.target,
+                           verify_policy( daemon.options ));
+  if ( rc == 0 )
+    remember( d, d.target );
+  return rc;
+}
+
+/** @return whether the cached brightness may answer a query */
+bool cache_valid( const Daemon& daemon, const Display& d ) {
+  return d.cached && daemon.options.cache_ttl_ms > 0 &&
+    now_ns() - d.cached_at < daemon.options.cache_ttl_ms * 1000000ULL;
+}
+
+/** Reads brightness of the display unless the cache knows it
+ * @return 0 on success, failure code of get_brightness() otherwise
+ */
+int daemon_current( Daemon& daemon, Display& d, int& value ) {
+  if ( cache_valid( daemon, d )) {
+    value = d.cached_value;
+    return 0;
+  }
+
+  int rc = get_brightness( d, value );
+  if ( rc == 0 )
+    remember( d, value );
+  return rc;
+}
+
+/** Starts watching events of a freshly opened display, they keep the
+ * brightness cache up to date */
+void daemon_attach( Daemon& daemon, Display& d ) {
+  if ( d.backend->enable_events() < 0 )
+    return;     /* old kernel or not hiddev, the TTL has to do */
+
+  epoll_event ev;
+  memset( &ev, 0, sizeof( ev ));
+  ev.events = EPOLLIN;
+  ev.data.fd = d.fd;
+  epoll_ctl( daemon.epoll_fd, EPOLL_CTL_ADD, d.fd, &ev );
+  daemon.devices[ d.fd ] = &d;
+}
+
+/** Closes the display, the next request reopens it */
+void daemon_detach( Daemon& daemon, Display& d ) {
+  daemon.devices.erase( d.fd );
+  close_display( d );
+  d.cached = false;
+}
+
+/** Updates the brightness cache from pending events of the display */
+void daemon_events( Daemon& daemon, Display& d ) {
+  hiddev_usage_ref ev[ 64 ];
+  ssize_t n = read( d.fd, ev, sizeof( ev ));
+  if ( n < 0 ) {
+    if ( errno == ENODEV )
+      daemon_detach( daemon, d );
+    return;
+  }
+
+  for ( size_t i = 0; i < n / sizeof( ev[ 0 ] ); ++i ) {
+    if ( ev[ i ].usage_code == d.layout.usage_code )
+      remember( d, ev[ i ].value );
+    else if ( ev[ i ].report_type != d.layout.report_type ||
+              ev[ i ].report_id != d.layout.report_id )
+      /* e.g. display buttons, the brightness might have changed */
+      d.cached = false;
+  }
+}
+
+/** Reports a failed background write of the display */
+void daemon_failure( Daemon& daemon, Display& d, int rc ) {
+  int error = errno;
+  cerr << d.path << ": " << io_failure( rc ) << ": " << strerror( error )
+       << endl;
+  if ( error == ENODEV )
+    daemon_detach( daemon, d );
+}
+
+/** Handles the end of the coalescing window of the display */
+void daemon_coalesce_timer( Daemon& daemon, Display& d ) {
+  uint64_t expirations;
+  if ( read( d.coalesce_fd, &expirations, sizeof( expirations )) < 0 )
+    return;
+
+  if ( !d.pending || d.fd < 0 ) {
+    d.coalescing = false;
+    return;
+  }
+
+  int rc = flush_coalesced( daemon, d );
+  if ( rc != 0 ) {
+    d.coalescing = false;
+    daemon_failure( daemon, d, rc );
+    return;
+  }
+
+  /* keep merging while the burst lasts */
+  arm_timer( d.coalesce_fd, daemon.options.coalesce_ms * 1000000ULL );
+}
+
+/** Performs the next step of the brightness ramp of the display */
+void daemon_fade_timer( Daemon& daemon, Display& d ) {
+  uint64_t expirations;
+  if ( read( d.fade_fd, &expirations, sizeof( expirations )) < 0 )
+    return;
+
+  if ( !d.fading || d.fd < 0 )
+    return;
+
+  int rc = fade_step( d );
+  if ( rc != 0 ) {
+    daemon_failure( daemon, d, rc );
+    return;
+  }
+  remember( d, d.fade_position );
+  if ( d.fading )
+    arm_timer( d.fade_fd, fade_interval( d ));
+}
+
+/** Reads back the brightness written last and counts it if the display did
+ * not take it */
+void daemon_verify_timer( Daemon& daemon, Display& d ) {
+  uint64_t expirations;
+  if ( read( d.verify_fd, &expirations, sizeof( expirations )) < 0 )
+    return;
+
+  /* a change in progress is verified when it is written */
+  if ( d.fd < 0 || d.fading || d.pending )
+    return;
+
+  int value;
+  int rc = get_brightness( d, value );
+  if ( rc != 0 ) {
+    daemon_failure( daemon, d, rc );
+    return;
+  }
+
+  ++daemon.verified;
+  if ( value != d.verify_expected ) {
+    ++daemon.mismatches;
+    cerr << d.path << ": wrote " << d.verify_expected << ", display has "
+         << value << endl;
+  }
+  remember( d, value );
+}
+
+/** Handles expiration of one of the display timers */
+void daemon_timer( Daemon& daemon, Display& d, int timer ) {
+  if ( timer == d.fade_fd )
+    daemon_fade_timer( daemon, d );
+  else if ( timer == d.verify_fd )
+    daemon_verify_timer( daemon, d );
+  else
+    daemon_coalesce_timer( daemon, d );
+}
+
+/** Makes sure the display is open, reopening it after it was unplugged */
+bool daemon_ensure_open( Daemon& daemon, Display& d, ostream& reply ) {
+  if ( d.fd >= 0 )
+    return true;
+
+  d.coalescing = false;
+  d.pending = false;
+  d.fading = false;
+
+  if ( !open_display( d, O_RDWR )) {
+    reply << "! " << d.path << " " << strerror( errno ) << "\n";
+    return false;
+  }
+
+  ostringstream err;
+  if ( prepare_display( d, daemon.options, err ) != 0 ) {
+    close_display( d );
+    reply << "! " << d.path << " cannot probe device\n";
+    return false;
+  }
+  daemon_attach( daemon, d );
+  return true;
+}
+
+/** Brightness operation requested by a client */
+struct Request {
+  int mode;
+  int value;                // brightness for SET, amount for SETREL
+  bool percent;             // value is given in percent of the range
+  int fade_ms;
+  int steps;
+  int verify;
+  bool force;               // write even if the display has the brightness
+};
+
+/** Starts or retargets the brightness ramp of the display
+ * @return 0 on success, failure code of get_brightness() otherwise
+ */
+int daemon_start_fade( Daemon& daemon, Display& d, const Request& r,
+                       int& target ) {
+  int from;
+  int rc;
+
+  if ( d.fading ) {
+    /* continue from where the running ramp is now */
+    from = d.fade_position;
+    target = d.fade_to;
+  } else {
+    if (( rc = flush_coalesced( daemon, d )) != 0 ||
+        ( rc = daemon_current( daemon, d, from )) != 0 )
+      return rc;
+    target = from;
+  }
+
+  target = r.mode == SET ? r.value : change_target( d, target, r.value );
+  if ( !daemon_add_timer( daemon, d, d.fade_fd ))
+    return set_brightness( d, target );
+
+  d.coalescing = false;
+  d.pending = false;
+  start_fade( d, from, target, r.fade_ms, r.steps );
+  arm_timer( d.fade_fd, fade_interval( d ));
+  return 0;
+}
+
+/** Performs the brightness operation on a single display */
+void daemon_serve( Daemon& daemon, Display& d, const Request& request,
+                   ostream& reply ) {
+  if ( !daemon_ensure_open( daemon, d, reply ))
+    return;
+
+  Request r = request;
+  if ( r.percent )
+    r.value = from_percent( d, r.value, r.mode == SETREL );
+
+  int mode = r.mode;
+  int value = r.value;
+  int brightness = value;
+  bool written = true;
+  int rc;
+
+  if ( mode != GET && r.fade_ms > 0 ) {
+    if (( rc = daemon_start_fade( daemon, d, r, brightness )) == 0 ) {
+      reply << "= " << d.path << " " << brightness << "\n";
+      return;
+    }
+  } else if ( mode == SETREL && d.coalescing ) {
+    d.target = change_target( d, d.target, value );
+    d.pending = true;
+    reply << "= " << d.path << " " << d.target << "\n";
+    return;
+  } else if ( mode == SET ) {
+    /* absolute brightness replaces merged changes and ramps */
+    d.pending = false;
+    d.coalescing = false;
+    d.fading = false;
+    if ( !r.force && cache_valid( daemon, d ) &&
+         same_brightness( d, d.cached_value, brightness )) {
+      written = false;
+      rc = 0;
+    } else {
+      rc = set_brightness( d, brightness );
+    }
+  } else if (( rc = flush_coalesced( daemon, d )) == 0 ) {
+    /* queries see merged changes */
+    if ( mode == SETREL )
+      d.fading = false;
+    rc = daemon_current( daemon, d, brightness );
+    written = false;
+    if ( rc == 0 && mode == SETREL ) {
+      int target = change_target( d, brightness, value );
+      if ( r.force || !same_brightness( d, brightness, target )) {
+        brightness = target;
+        written = true;
+        if (( rc = set_brightness( d, brightness )) == 0 )
+          rc = daemon_read_back( daemon, d, brightness, r.verify );
+      }
+    }
+  }
+
+  if ( rc != 0 ) {
+    int error = errno;
+    reply << "! " << d.path << " " << io_failure( rc ) << ": "
+          << strerror( error ) << "\n";
+    /* the device is gone, the next request reopens it */
+    if ( error == ENODEV )
+      daemon_detach( daemon, d );
+    return;
+  }
+
+  /* a skipped write leaves the cache as it is */
+  if ( written )
+    remember( d, brightness );
+  if ( written && mode == SETREL && daemon.options.coalesce_ms > 0 ) {
+    d.target = brightness;
+    start_coalescing( daemon, d );
+  }
+  reply << "= " << d.path << " " << brightness << "\n";
+}
+
+/** Parses and executes a single request line */
+void daemon_request( Daemon& daemon, const string& line, ostream& reply ) {
+  Displays& displays = daemon.displays;
+  istringstream in( line );
+  string word;
+  Request r;
+
+  r.value = 0;
+  r.percent = false;
+  r.fade_ms = max( 0, daemon.options.fade_ms );
+  r.steps = daemon.options.steps;
+  r.verify = verify_policy( daemon.options );
+  r.force = daemon.options.force_write;
+
+  in >> word;
+  if ( word == "STATS" ) {
+    reply << "= verified " << daemon.verified << "\n"
+          << "= mismatches " << daemon.mismatches << "\n.\n";
+    return;
+  } else if ( word == "GET" )
+    r.mode = GET;
+  else if ( word == "SET" )
+    r.mode = SET;
+  else if ( word == "SETREL" )
+    r.mode = SETREL;
+  else {
+    reply << "! - unknown request\n.\n";
+    return;
+  }
+
+  if ( r.mode != GET ) {
+    if ( !( in >> word ) || !number( word.c_str() )) {
+      reply << "! - missing brightness\n.\n";
+      return;
+    }
+    r.value = atoi( word.c_str() );
+    r.percent = word[ word.size() - 1 ] == '%';
+  }
+
+  list< string > selectors;
+  while ( in >> word ) {
+    if ( word.compare( 0, 5, "fade=" ) == 0 )
+      r.fade_ms = atoi( word.c_str() + 5 );
+    else if ( word.compare( 0, 6, "steps=" ) == 0 )
+      r.steps = atoi( word.c_str() + 6 );
+    else if ( word.compare( 0, 7, "verify=" ) == 0 &&
+              parse_verify( word.c_str() + 7 ) >= 0 )
+      r.verify = parse_verify( word.c_str() + 7 );
+    else if ( word == "force" )
+      r.force = true;
+    else
+      selectors.push_back( word );
+  }
+
+  if ( selectors.empty() ) {
+    for ( Displays::iterator d = displays.begin(); d != displays.end(); ++d )
+      daemon_serve( daemon, *d, r, reply );
+  }
+
+  for ( list< string >::iterator s = selectors.begin(); s != selectors.end();
+        ++s ) {
+    bool found = false;
+    for ( Displays::iterator d = displays.begin(); d != displays.end(); ++d ) {
+      if ( selects( *d, *s )) {
+        daemon_serve( daemon, *d, r, reply );
+        found = true;
+      }
+    }
+    if ( !found )
+      reply << "? " << *s << "\n";
+  }
+  reply << ".\n";
+}
+
+/** Reads requests from a client connection and answers the complete ones
+ * @param fd client connection
+ * @param pending request data received so far
+ * @return false if the connection should be closed
+ */
+bool daemon_client( Daemon& daemon, int fd, string& pending ) {
+  char buf[ 512 ];
+  ssize_t n = read( fd, buf, sizeof( buf ));
+  if ( n <= 0 )
+    return n < 0 && errno == EINTR;
+
+  pending.append( buf, n );
+  string::size_type eol;
+  while (( eol = pending.find( '\n' )) != string::npos ) {
+    ostringstream reply;
+    daemon_request( daemon, pending.substr( 0, eol ), reply );
+    pending.erase( 0, eol + 1 );
+
+    string s = reply.str();
+    if ( send( fd, s.data(), s.size(), MSG_NOSIGNAL ) != (ssize_t)s.size() )
+      return false;
+  }
+  /* nobody sends requests that long */
+  return pending.size() < 4096;
+}
+
+/** Runs the daemon until it is terminated by a signal
+ * @param files devices to control
+ * @return program exit code
+ */
+int run_daemon( const FileList& files, const Options& options ) {
+  Daemon daemon( options );
+  Displays& displays = daemon.displays;
+  int ep = daemon.epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+  for ( FileList::const_iterator it = files.begin();
+        it != files.end(); ++it ) {
+    Display d( *it );
+    if ( !open_display( d, O_RDWR )) {
+      perror( *it );
+      continue;
+    }
+    if ( prepare_display( d, options, cerr ) != 0 ) {
+      close_display( d );
+      continue;
+    }
+    displays.push_back( d );
+    daemon_attach( daemon, displays.back() );
+  }
+  save_discovery_cache( options );
+
+  if ( displays.empty() ) {
+    cerr << "FATAL: No display to control" << endl;
+    return 1;
+  }
+
+  int listen_fd = daemon_listen( options.socket_path );
+  if ( listen_fd < 0 ) {
+    perror( options.socket_path );
+    return 1;
+  }
+
+  catch_quit_signals();
+  signal( SIGPIPE, SIG_IGN );
+
+  epoll_event ev;
+  memset( &ev, 0, sizeof( ev ));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl( ep, EPOLL_CTL_ADD, listen_fd, &ev );
+
+  if ( !options.silent )
+    printf( "Serving %d display(s) on %s\n", (int)displays.size(),
+            options.socket_path );
+
+  /* pending request data of every connected client */
+  map< int, string > clients;
+
+  while ( !quit_requested ) {
+    epoll_event events[ 16 ];
+    int n = epoll_wait( ep, events, 16, -1 );
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror( "epoll_wait" );
+      break;
+    }
+
+    for ( int i = 0; i < n; ++i ) {
+      int fd = events[ i ].data.fd;
+
+      if ( fd == listen_fd ) {
+        int client = accept4( listen_fd, 0, 0, SOCK_CLOEXEC );
+        if ( client < 0 )
+          continue;
+        /* do not let a stuck client block everybody else */
+        timeval timeout = { 1, 0 };
+        setsockopt( client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                    sizeof( timeout ));
+        ev.data.fd = client;
+        epoll_ctl( ep, EPOLL_CTL_ADD, client, &ev );
+        clients[ client ];
+        continue;
+      }
+
+      map< int, Display* >::iterator timer = daemon.timers.find( fd );
+      if ( timer != daemon.timers.end() ) {
+        daemon_timer( daemon, *timer->second, fd );
+        continue;
+      }
+
+      map< int, Display* >::iterator device = daemon.devices.find( fd );
+      if ( device != daemon.devices.end() ) {
+        daemon_events( daemon, *device->second );
+        continue;
+      }
+
+      if ( !daemon_client( daemon, fd, clients[ fd ] )) {
+        epoll_ctl( ep, EPOLL_CTL_DEL, fd, 0 );
+        close( fd );
+        clients.erase( fd );
+      }
+    }
+  }
+
+  for ( map< int, string >::iterator c = clients.begin(); c != clients.end();
+        ++c )
+    close( c->first );
+  close( ep );
+  close( listen_fd );
+  unlink( options.socket_path );
+
+  for ( Displays::iterator d = displays.begin(); d != displays.end(); ++d ) {
+    if ( d->fd >= 0 )
+      flush_coalesced( daemon, *d );
+    if ( d->coalesce_fd >= 0 )
+      close( d->coalesce_fd );
+    if ( d->fade_fd >= 0 )
+      close( d->fade_fd );
+    if ( d->verify_fd >= 0 )
+      close( d->verify_fd );
+    close_display( *d );
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Watch mode
+//
+// The displays are switched to hiddev_usage_ref events and watched with epoll,
+// so nothing is polled while the brightness does not change.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Reads pending events of the display and prints its brightness if it
+ * changed.
+ * @param d watched display
+ * @param last last printed brightness
+ * @return false once the display is gone
+ */
+bool watch_events( Display& d, int& last, const Options& options ) {
+  hiddev_usage_ref ev[ 64 ];
+  ssize_t n = read( d.fd, ev, sizeof( ev ));
+  if ( n < 0 )
+    return errno == EINTR || errno == EAGAIN;
+  if ( n == 0 )
+    return false;
+
+  int value = last;
+  bool known = false;
+  bool other = false;
+  for ( size_t i = 0; i < n / sizeof( ev[ 0 ] ); ++i ) {
+    if ( ev[ i ].usage_code == d.layout.usage_code ) {
+      value = ev[ i ].value;
+      known = true;
+    } else if ( ev[ i ].report_type != d.layout.report_type ||
+                ev[ i ].report_id != d.layout.report_id ) {
+      other = true;
+    }
+  }
+
+  /* some other report came in, e.g. from the display buttons; answers to
+     our own brightness reads carry the value already */
+  if ( !known && other ) {
+    int rc = get_brightness( d, value );
+    if ( rc != 0 ) {
+      perror( d.path.c_str() );
+      return errno != ENODEV;
+    }
+  }
+
+  if ( value != last ) {
+    print_brightness( cout, d, value, options );
+    last = value;
+  }
+  return true;
+}
+
+/** Prints brightness of the displays whenever it changes, until terminated
+ * by a signal.
+ * @param files devices to watch
+ * @return program exit code
+ */
+int run_watch( const FileList& files, const Options& options ) {
+  Displays displays;
+  map< Display*, int > last;
+  int ep = epoll_create1( EPOLL_CLOEXEC );
+
+  for ( FileList::const_iterator it = files.begin(); it != files.end(); ++it ) {
+    Display d( *it );
+    int value;
+    int rc;
+
+    if ( !open_display( d, O_RDONLY )) {
+      perror( *it );
+      continue;
+    }
+    if (( rc = prepare_display( d, options, cerr )) != 0 ) {
+      close_display( d );
+      if ( rc > 0 )
+        return rc;
+      continue;
+    }
+    if ( d.backend->enable_events() < 0 ||
+         ( rc = get_brightness( d, value )) != 0 ) {
+      perror( *it );
+      close_display( d );
+      continue;
+    }
+
+    displays.push_back( d );
+    Display* w = &displays.back();
+    epoll_event ev;
+    memset( &ev, 0, sizeof( ev ));
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    epoll_ctl( ep, EPOLL_CTL_ADD, w->fd, &ev );
+
+    print_brightness( cout, *w, value, options );
+    last[ w ] = value;
+  }
+
+  save_discovery_cache( options );
+  catch_quit_signals();
+
+  while ( !quit_requested && !last.empty() ) {
+    epoll_event events[ 16 ];
+    int n = epoll_wait( ep, events, 16, -1 );
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror( "epoll_wait" );
+      break;
+    }
+
+    for ( int i = 0; i < n; ++i ) {
+      Display* w = (Display*)events[ i ].data.ptr;
+      if ( !watch_events( *w, last[ w ], options )) {
+        cerr << w->path << ": display is gone" << endl;
+        epoll_ctl( ep, EPOLL_CTL_DEL, w->fd, 0 );
+        close_display( *w );
+        last.erase( w );
+      }
+    }
+  }
+
+  close( ep );
+  for ( Displays::iterator d = displays.begin(); d != displays.end(); ++d )
+    close_display( *d );
+  return displays.empty() ? 1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Daemon client
+//
+// Regular invocations forward the operation to a running daemon, so they do
+// not need to open and probe the devices at all. Devices the daemon does not
+// manage are handled directly.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Connects to a running daemon
+ * @param path daemon socket
+ * @return connected socket or -1 if no daemon is listening there
+ */
+int daemon_connect( const char* path ) {
+  struct stat st;
+  sockaddr_un addr;
+
+  if ( stat( path, &st ) < 0 || !S_ISSOCK( st.st_mode ) ||
+       !socket_address( addr, path ))
+    return -1;
+
+  int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( fd < 0 )
+    return -1;
+  if ( connect( fd, (sockaddr*)&addr, sizeof( addr )) < 0 ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+/** Forwards the operation on every device to the daemon and prints results
+ * the same way the direct mode does. Only stdio is used here.
+ * @param fd connection to the daemon, closed on return
+ * @param mode GET, SET or SETREL
+ * @param value brightness for SET, amount for SETREL
+ * @param files devices to operate on, all displays of the daemon if empty;
+ *        on return holds the devices the daemon does not manage
+ * @return program exit code, -1 if the daemon could not be asked at all
+ */
+int run_client( int fd, int mode, int value, FileList& files,
+                const Options& options ) {
+  const char* request = mode == SET ? "SET" : mode == SETREL ? "SETREL" : "GET";
+  char line[ PATH_MAX + 64 ];
+  char resolved[ PATH_MAX ];
+  int rc = 0;
+
+  /* without devices a single request covers all displays of the daemon */
+  bool all = files.empty();
+  if ( all )
+    files.push_back( "" );
+
+  /* pipeline one request per device, replies come back in order */
+  string requests;
+  for ( FileList::iterator it = files.begin(); it != files.end(); ++it ) {
+    /* the daemon runs in another directory */
+    const char* path = realpath( *it, resolved ) ? resolved : *it;
+    const char* unit = options.percent ? "%" : "";
+    string flags = options.verify < 0 ? "" :
+      string( "verify=" ) + VERIFY_NAMES[ options.verify ] + " ";
+    if ( options.force_write )
+      flags += "force ";
+    if ( mode == GET )
+      snprintf( line, sizeof( line ), "%s %s\n", request, path );
+    else if ( options.fade_ms >= 0 )
+      snprintf( line, sizeof( line ), "%s %d%s fade=%d steps=%d %s%s\n",
+                request, value, unit, options.fade_ms, options.steps,
+                flags.c_str(), path );
+    else
+      snprintf( line, sizeof( line ), "%s %d%s %s%s\n", request, value, unit,
+                flags.c_str(), path );
+    requests += line;
+  }
+
+  FILE* in = fdopen( fd, "r" );
+  if ( !in ||
+       send( fd, requests.data(), requests.size(), MSG_NOSIGNAL ) !=
+       (ssize_t)requests.size() ) {
+    if ( in )
+      fclose( in );
+    else
+      close( fd );
+    if ( all )
+      files.clear();
+    return -1;  /* nothing was done, handle all devices directly */
+  }
+
+  FileList unmanaged;
+  FileList::iterator it = files.begin();
+  while ( it != files.end() && fgets( line, sizeof( line ), in )) {
+    line[ strcspn( line, "\n" ) ] = 0;
+    if ( strcmp( line, "." ) == 0 ) {
+      ++it;
+      continue;
+    }
+
+    /* the daemon names the display itself */
+    char* arg = strchr( line + 2, ' ' );
+    if ( arg )
+      *arg++ = 0;
+    else
+      arg = line + strlen( line );
+    const char* name = all ? line + 2 : *it;
+
+    switch ( line[ 0 ] ) {
+    case '=':
+      if ( mode == SET )
+        break;
+      if ( !options.brief )
+        printf( "%s: BRIGHTNESS=", name );
+      printf( "%s\n", arg );
+      break;
+    case '!':
+      fprintf( stderr, "%s: %s\n", name, arg );
+      rc = 2;
+      break;
+    case '?':
+      unmanaged.push_back( *it );
+      break;
+    }
+  }
+
+  /* the daemon went away, do the rest directly */
+  unmanaged.splice( unmanaged.end(), files, it, files.end() );
+  files.swap( unmanaged );
+  if ( all )
+    files.clear();
+  fclose( in );
+  return rc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Monitor state
+//
+// --save writes all monitor controls of the displays to a file, --restore
+// writes them back. Either way a display costs one transfer per report holding
+// monitor controls. Each line of the file holds one report field:
+//
+//   <device> <report id> <field index> <usage code>=<value>...
+////////////////////////////////////////////////////////////////////////////////
+
+typedef map< string, vector< string > > SavedStates;  // lines by device
+SavedStates saved_states;
+
+/** Loads the state file for --restore, "-" for standard input
+ * @return false if the file cannot be read
+ */
+bool load_state( const char* path ) {
+  ifstream file;
+  istream* in = &cin;
+  if ( strcmp( path, "-" ) != 0 ) {
+    file.open( path );
+    if ( !file )
+      return false;
+    in = &file;
+  }
+
+  string line;
+  while ( getline( *in, line )) {
+    if ( line.empty() || line[ 0 ] == '#' )
+      continue;
+    saved_states[ line.substr( 0, line.find( ' ' )) ].push_back( line );
+  }
+  return true;
+}
+
+/** Reads all monitor controls of the display
+ * @param out stream to write the state lines to
+ * @return 0 on success, failure code of get_fields() otherwise
+ */
+int save_state( Display& d, ostream& out ) {
+  vector< const Field* > fields = monitor_fields( report_map( d ).fields );
+  FieldValues values;
+  int rc = get_fields( d, fields, values );
+  if ( rc != 0 )
+    return rc;
 
-  SupportedDevices::const_iterator i = supportedDevices.find( DeviceId( vendor, product, "" ));
-  if (i != supportedDevices.end())
-	  return &*i;
+  for ( size_t i = 0; i < fields.size(); ++i ) {
+    out << d.path << " " << dec << fields[ i ]->report_id << " "
+        << fields[ i ]->field_index;
+    for ( size_t u = 0; u < values[ i ].size(); ++u )
+      out << " " << hex << showbase << fields[ i ]->codes[ u ] << "="
+          << dec << values[ i ][ u ];
+    out << endl;
+  }
   return 0;
 }
 
-/**
- * @param v query vendor
- * @param p query product
- * @return description of the device with given vendor and product 
+/** Parses the saved values of a field
+ * @return false if the line does not describe the field
  */
-string description ( Vendor v, Product p ) {
-  SupportedDevices::iterator it = 
-    supportedDevices.find( DeviceId( v, p, "" ));
+bool parse_field( const string& line, const Field& f, vector< int >& values ) {
+  istringstream in( line );
+  string path, control;
+  unsigned report_id, field_index, code;
+  int value;
 
-  if ( it != supportedDevices.end() )
-    return it->description;
+  if ( !( in >> path >> report_id >> field_index ) ||
+       report_id != f.report_id || field_index != f.field_index )
+    return false;
 
-  return "";
+  while ( in >> control ) {
+    if ( sscanf( control.c_str(), "%x=%d", &code, &value ) != 2 ||
+         values.size() >= field_values( f ) ||
+         code != f.codes[ values.size() ] )
+      return false;
+    values.push_back( value );
+  }
+  return values.size() == field_values( f );
 }
 
-/** @param v vendor to query
- * @return true if the venodr is in the database 
+/** Writes the saved monitor controls back to the display
+ * @return 0 on success, 1 if the saved state does not match the display,
+ *         failure code of set_fields() otherwise
  */
-bool known_vendor ( Vendor v ) {
-  v &= 0xFFFF;
-  return supportedVendors.find( v ) != supportedVendors.end();
-}
+int restore_state( Display& d ) {
+  vector< const Field* > fields = monitor_fields( report_map( d ).fields );
+  SavedStates::const_iterator it = saved_states.find( d.path );
+  if ( it == saved_states.end() || it->second.size() != fields.size() )
+    return 1;
 
-/** Checks whether the HID device is a usb monitor 
- * @param device_info HID device info
- * @param fd file to read applications from
- */
-bool is_usb_monitor ( const hiddev_devinfo& device_info, int fd ) {
-  
-  /* Now that we have the number of applications, we can retrieve them */
-  /* using the HIDIOCAPPLICATION ioctl() call */
-  /* applications are indexed from 0..{num_applications-1} */
-  for ( int appl_num = 0; appl_num < device_info.num_applications; 
-        ++appl_num ) {
-    int application = ioctl( fd, HIDIOCAPPLICATION, appl_num );
-    /* The magic values come from various usage table specs */
-    if ( ((application >> 16) & 0xFF) == 0x80 ) {
-      return true;
-    }
-  }
-  return false;
+  FieldValues values( fields.size() );
+  for ( size_t i = 0; i < fields.size(); ++i )
+    if ( !parse_field( it->second[ i ], *fields[ i ], values[ i ] ))
+      return 1;
+  return set_fields( d, fields, values );
 }
 
-/** Pretty-prints the given device information
- * @param o output stream to print to
- * @param device_info HID device info
+////////////////////////////////////////////////////////////////////////////////
+// Direct mode
+//
+// Every device is opened, probed and operated on by itself, so the devices are
+// handled in parallel. Output is collected per device and printed in the order
+// of the command line.
+////////////////////////////////////////////////////////////////////////////////
+
+/** Result of the operation on a single device */
+struct Outcome {
+  const char* path;
+  int rc;                   // 0, -1 if skipped, program exit code otherwise
+  bool opened;
+  int version;
+  string out;
+  string err;
+};
+
+/** Performs the brightness operation on a probed display
+ * @param mode GET, SET or SETREL
+ * @param value brightness for SET, amount for SETREL
+ * @param brightness receives the resulting brightness
+ * @return 0 on success, failure code of get_brightness()/set_brightness()
  */
-void format_device( ostream& o, const hiddev_devinfo& device_info ) {
-  Vendor  v = device_info.vendor & 0xFFFF;
-  Product p = device_info.product & 0xFFFF;
-  o << "Vendor=" << showbase << setw( 6 ) << hex << v;
-  if ( known_vendor( v ) )
-    o << " (" << supportedVendors[ v ] << ")";
-  
-  o << ", Product=" << showbase << setw( 6 ) << hex << p ;
+int change_brightness( Display& d, int mode, int value, const Options& options,
+                       int& brightness ) {
+  int rc;
 
-  if ( is_supported( device_info )) 
-    o << "[" << description( v, p ) << "]";
+  if ( options.percent )
+    value = from_percent( d, value, mode == SETREL );
 
-  o << endl;
-}
+  brightness = value;
+  /* reading the brightness just to compare costs as much as writing it, so
+   * an absolute one is compared only if the display is read anyway, i.e.
+   * primed before the first write */
+  if ( mode == SET && options.fade_ms <= 0 &&
+       !( display_quirks( d ) & QUIRK_PRIME_WRITE ))
+    return set_brightness( d, value );
 
+  if (( rc = get_brightness( d, brightness )) != 0 )
+    return rc;
+  if ( mode == GET )
+    return 0;
 
-/** Debug routine for dumping device usage 
- * @param usage_ref usage description 
- */
-void dump_usage ( hiddev_usage_ref& usage_ref ) {
-  printf ("  report_type   =%d\n", usage_ref.report_type );
-  printf ("  report_id     =%d\n", usage_ref.report_id );
-  printf ("  field_index   =%d\n", usage_ref.field_index );
-  printf ("  usage_index   =%d\n", usage_ref.usage_index );
-  printf ("  usage_code    =%d\n", usage_ref.usage_code );
+  /* the display has the brightness already */
+  int target = mode == SET ? value : change_target( d, brightness, value );
+  if ( !options.force_write && same_brightness( d, brightness, target ))
+    return 0;
+
+  if ( options.fade_ms > 0 )
+    rc = fade_brightness( d, brightness, target, options.fade_ms,
+                          options.steps );
+  else
+    rc = set_brightness( d, target );
+  brightness = target;
+
+  /* read brightness back from device as the policy says; there is nobody to
+   * verify it later */
+  int verify = verify_policy( options );
+  if ( rc == 0 && mode == SETREL )
+    rc = read_back( d, brightness, verify == VERIFY_ASYNC ? VERIFY_SYNC :
+                    verify );
+  return rc;
 }
 
-/** Prints help for the program.
- * @param programName this program name
+/** Performs the operation on a single device
+ * @param mode GET, SET, SETREL, DETECT, DUMP, SAVE or RESTORE
+ * @param value brightness for SET, amount for SETREL
+ * @param o outcome to fill, path must be set
  */
-void help( const char *programName ) {
-  printf( "acdcontrol " VERSION "\n");
+void process_device( int mode, int value, const Options& options,
+                     Outcome& o ) {
+  ostringstream out, err;
+  Display d( o.path );
+  int brightness;
+  int rc = 0;
 
-  printf( "USAGE: %s [--silent|-s] [--brief|-b] [--help|-h] [--about|-a] "
-          "[--detect|-d] [--list-all |-l] <hid device(s)> [<brightness>]\n\n"
-          "Parameters:\n"
-          "  --silent,-s\n"
-          "         Suppress non-functional program output\n"
-          "  --brief,-b\n"
-          "         Print brightness value only when in query mode,\n"
-          "         otherwise ignored.\n"
-          "  --detect, -d\n"
-          "         Perform detection only\n"
-          "  --list-all, -l\n"
-          "         List supported devices and exit\n"
-          "  --help,-h\n"
-          "         Show short help message and quit.\n"
-          "  --about,-a\n"
-          "         Show information about the program, some credits and thanks.\n"
-          "  hid device\n"
-          "         device that represents your Apple Cinema display.\n"
-          "         It shoud normally be one of /dev/usb/hiddevX. or /dev/hiddevX\n"
-          "      Note\n"
-          "         You must have write permissions to this device.\n"
-          "      Note\n"
-          "         It should be safe to run the program on other device than\n"
-          "         Apple Cinema/Studio Display as the program checks whether\n"
-          "         the device is Apple display and warns about it.\n"
-          "  brightness\n"
-          "         When this option is specified, the operation is to set brightness,\n"
-          "         otherwise, current brightness is retreived. If brightness starts\n"
-          "         with '+' or '-', the current brightness is increased or decreased\n"
-          "         by that value.\n"
-          "      Note\n"
-          "         Preceed brightness decrement by '--'.\n"
-          "      See also: --brief option.\n"
+  o.opened = open_display( d, mode == GET || mode == DETECT || mode == DUMP ||
+                           mode == SAVE ? O_RDONLY : O_RDWR );
+  o.version = d.version;
 
-          "\n\nEXAMPLES:\n\n"
-          "In the following examples I assume that your HID device is /dev/hiddev0. You may \n"
-          "have it as /dev/hiddevX or /dev/usb/hiddevX.\n"
-          "\n"
-          "  acdcontrol\n"
-          "  acdcontrol --help\n"
-          "      Show long help message.\n"
-          "\n"
-          "  acdcontrol --detect /dev/hiddev*\n"
-          "      Perform detection, which HID device is actually your display to be controlled.\n"
-          "\n"
-          "  acdcontrol /dev/hiddev0\n"
-          "      Read current brightness parameter\n"
-          "\n"
-          "  acdcontrol /dev/hiddev0 160\n"
-          "      Set brightness to 160. Note, that brightness setting depends on your model. \n"
-          "      Generally, this parameter may get values in the range [0-255].\n"
-          "\n"
-          "  acdcontrol /dev/hiddev0 +10\n"
-          "      Increment current brightness by 10.\n"
-          "\n"
-          "  acdcontrol /dev/hiddev0 -- -10\n"
-          "      Decrement current brightness by 10. Please,note '--'!\n"
-          ,
+  if ( !o.opened ) {
+    err << o.path << ": " << strerror( errno ) << endl;
+    rc = -1;
+  } else if ( mode == DETECT ) {
+    if ( is_usb_monitor( d ) ) {
+      out << o.path << ": USB Monitor - "
+          << (is_supported( d.device_info ) ? "SUPPORTED": "UNSUPPORTED")
+          << ".\t";
+      format_device( out, d.device_info );
+    }
+  } else if ( mode == DUMP ) {
+    out << o.path << ": ";
+    format_device( out, d.device_info );
+    if ( d.backend->init_report() < 0 ) {
+      err << o.path << ": Failed to initialize internal report structures"
+          << endl;
+    } else {
+      UsageMap usages;
+      walk_reports( *d.backend, usages, 0, &out );
+    }
+  } else if (( rc = prepare_display( d, options, err )) != 0 ) {
+    /* reported already */
+  } else if ( mode == SAVE ) {
+    if (( rc = save_state( d, out )) != 0 )
+      err << o.path << ": " << io_failure( rc ) << ": " << strerror( errno )
+          << endl;
+  } else if ( mode == RESTORE ) {
+    if (( rc = restore_state( d )) == 1 )
+      err << o.path << ": saved state does not match the display" << endl;
+    else if ( rc != 0 )
+      err << o.path << ": " << io_failure( rc ) << ": " << strerror( errno )
+          << endl;
+  } else {
+    if (( rc = change_brightness( d, mode, value, options, brightness )) != 0 )
+      err << io_failure( rc ) << ": " << strerror( errno ) << endl;
+    else if ( mode != SET )
+      print_brightness( out, d, brightness, options );
+  }
 
-      
-          programName );
+  close_display( d );
+  o.rc = rc;
+  o.out = out.str();
+  o.err = err.str();
 }
 
-/** Prints brief notice about the program */
-void notice() {
-  printf( "Apple Cinema and Studio Display Control Program. Please, use --about switch to learn more\n" );
-}
+/** Performs the operation on all devices using up to options.jobs threads
+ * @param outcomes one entry per device with the path set
+ */
+void process_devices( int mode, int value, const Options& options,
+                      vector< Outcome >& outcomes ) {
+  size_t jobs = options.jobs > 0 ? options.jobs : outcomes.size();
+  jobs = min( jobs, outcomes.size() );
 
-/** Prints detailed info about this program */
-void about() {
-  printf( "acdcontrol " VERSION "\n");
+  if ( jobs <= 1 ) {
+    /* a failing device ends the program before the rest is touched */
+    for ( size_t i = 0; i < outcomes.size(); ++i ) {
+      process_device( mode, value, options, outcomes[ i ] );
+      if ( outcomes[ i ].rc > 0 )
+        break;
+    }
+    return;
+  }
 
-  printf( "Written by Pavel Gurevich.\n\n"
-          "This program is a free software and is distributed under GPL2\n\n"
-          "CREDITS\n\n"
-          "This program would never possibly come out without valuable help of Andre Beckedorf."
-          " Andre wrote a similar software for Windows. Please, visit http://metaexception.de/."
-          " Andre would like to thank to people that helped him to write his software and I'd "
-          "like to join him as they helped me that way :)\n\n"
-          "    * Dmitri Kitaynik (20\" Display)\n"
-          "    * Mark Wagner (15\" and 17\" Displays)\n" 
-          "    * Veit Wahlich (30\" Display)\n" 
-          "    * Charles Lepple (24\" Display)\n" 
-          "    * Arne Zellentin (relative brightness change)\n\n"
-          " Please, visit http://acdcontrol.sf.net for updates\n"
-          "NOTE: You can suppress a startup message with --silent (-s) option\n"
-          );
+  atomic< size_t > next( 0 );
+  vector< thread > workers;
+  for ( size_t j = 0; j < jobs; ++j ) {
+    workers.push_back( thread( [&]() {
+      size_t i;
+      while (( i = next++ ) < outcomes.size() )
+        process_device( mode, value, options, outcomes[ i ] );
+    } ));
+  }
+  for ( size_t j = 0; j < workers.size(); ++j )
+    workers[ j ].join();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -301,53 +4919,62 @@ void about() {
 // |_| |_| |_|  \__,_| |_|  |_| |_|
 //
 ////////////////////////////////////////////////////////////////////////////////
+/* acdcontrol-bench compiles the program in with a main() of its own */
+#ifndef ACDCONTROL_NO_MAIN
 int main (int argc, char **argv) {
-  int fd = -1;
-  int rd, i;
-  int alv, yalv;
-  struct hiddev_devinfo device_info;
-  struct hiddev_report_info rep_info;
-  struct hiddev_field_info field_info;
-  struct hiddev_usage_ref usage_ref;
-  struct hiddev_event ev[64];
-  fd_set fdset;
-  int report_type;
-  int appl;
-  int version;
   int brightness = 0;
   int amount = 0;
   int mode = GET;
-  int open_mode = O_RDONLY;
   
   /* Behavior options */
-  bool brief  = false;
-  bool silent = false;
-  bool force = false;
+  Options options;
 
   bool first_device=true;
+  bool direct = false;
+  bool list_all = false;
+  const char* db_source = 0;
+  int status = 0;
     
   int c;
-  int digit_optind = 0;
 
-  const DeviceId* selected_device = 0;
-
-  init_device_database();
-  
   while (1) {
-    int this_option_optind = optind ? optind : 1;
     int option_index = 0;
     static struct option long_options[] = {
       {"about", 0, 0, 'a'},
       {"brief", 0, 0, 'b'},
+      {"verbose", 0, 0, 'v'},
       {"help", 0, 0, 'h'},
       {"silent", 0, 0, 's'},
       {"force", 0, 0, 'f'},
       {"detect", 0, 0, 'd'},
       {"list-all", 0, 0, 'l'},
+      {"daemon", 0, 0, 'D'},
+      {"socket", 1, 0, 'S'},
+      {"direct", 0, 0, 'X'},
+      {"coalesce", 1, 0, 'C'},
+      {"watch", 0, 0, 'w'},
+      {"fade", 1, 0, 'F'},
+      {"cache-ttl", 1, 0, 'L'},
+      {"jobs", 1, 0, 'j'},
+      {"auto", 0, 0, 'A'},
+      {"probe-timeout", 1, 0, 'P'},
+      {"sysfs-root", 1, 0, 'R'},
+      {"dev-root", 1, 0, 'Q'},
+      {"discovery-cache", 1, 0, 'K'},
+      {"steps", 1, 0, 'T'},
+      {"dump", 0, 0, 'U'},
+      {"device-db", 1, 0, 'B'},
+      {"compile-db", 1, 0, 'Y'},
+      {"save", 1, 0, 'V'},
+      {"verify", 1, 0, 'E'},
+      {"force-write", 0, 0, 'G'},
+      {"restore", 1, 0, 'W'},
+      {"backend", 1, 0, 'N'},
+      {"record", 1, 0, 'O'},
       {0, 0, 0, 0}
     };
       
-    c = getopt_long (argc, argv, "abhsdl",
+    c = getopt_long (argc, argv, "abhsdlv",
                      long_options, &option_index);
     if (c == -1)
       break;
@@ -358,7 +4985,11 @@ int main (int argc, char **argv) {
       exit( 0 );
         
     case 'b':
-      brief=true;
+      options.brief=true;
+      break;
+
+    case 'v':
+      options.verbose=true;
       break;
         
     case 'h':
@@ -367,11 +4998,11 @@ int main (int argc, char **argv) {
       break;
         
     case 's':
-      silent=true;
+      options.silent=true;
       break;
       
     case 'f':
-      force=true;
+      options.force=true;
       break;
 
     case 'd':
@@ -379,8 +5010,112 @@ int main (int argc, char **argv) {
       break;
 
     case 'l':
-      dump_supported();
-      exit( 0 );
+      list_all=true;
+      break;
+
+    case 'D':
+      mode=DAEMON;
+      break;
+
+    case 'w':
+      mode=WATCH;
+      break;
+
+    case 'U':
+      mode=DUMP;
+      break;
+
+    case 'S':
+      options.socket_path=optarg;
+      break;
+
+    case 'X':
+      direct=true;
+      break;
+
+    case 'C':
+      options.coalesce_ms=atoi( optarg );
+      break;
+
+    case 'F':
+      options.fade_ms=atoi( optarg );
+      break;
+
+    case 'T':
+      options.steps=atoi( optarg );
+      break;
+
+    case 'L':
+      options.cache_ttl_ms=atoi( optarg );
+      break;
+
+    case 'j':
+      options.jobs=atoi( optarg );
+      break;
+
+    case 'A':
+      options.auto_detect=true;
+      break;
+
+    case 'P':
+      options.probe_timeout_ms=atoi( optarg );
+      break;
+
+    case 'R':
+      options.sysfs_root=optarg;
+      break;
+
+    case 'Q':
+      options.dev_root=optarg;
+      break;
+
+    case 'K':
+      options.discovery_cache=optarg;
+      break;
+
+    case 'B':
+      options.device_db=optarg;
+      break;
+
+    case 'Y':
+      db_source=optarg;
+      break;
+
+    case 'E':
+      if (( options.verify=parse_verify( optarg )) < 0 ) {
+        fprintf( stderr, "Unknown verification policy '%s'\n", optarg );
+        exit( 2 );
+      }
+      break;
+
+    case 'G':
+      options.force_write=true;
+      break;
+
+    case 'N':
+      if (( options.backend=parse_backend( optarg )) < 0 ) {
+        fprintf( stderr, "Unknown backend '%s'\n", optarg );
+        exit( 2 );
+      }
+      if ( options.backend == BACKEND_MOCK && optarg[ 4 ] )
+        options.backend_spec = optarg + 5;
+      else if ( options.backend == BACKEND_REPLAY )
+        options.backend_spec = optarg + 7;
+      break;
+
+    case 'O':
+      options.record_file=optarg;
+      break;
+
+    case 'V':
+      mode=SAVE;
+      options.state_file=optarg;
+      break;
+
+    case 'W':
+      mode=RESTORE;
+      options.state_file=optarg;
+      break;
         
     default:
       fprintf (stderr,"Unknown option '%c'\n", c);
@@ -389,11 +5124,56 @@ int main (int argc, char **argv) {
     }
   }
 
-  typedef list< const char* > FileList;
+  if ( db_source )
+    exit( compile_device_db( db_source, *options.device_db ?
+                             options.device_db : DEFAULT_DEVICE_DB ));
+
+  if ( !load_device_db( options.device_db ))
+    cerr << options.device_db << ": not a device database, ignored" << endl;
+
+  /* mock displays pretend to be models of the database; a running daemon
+   * has real ones */
+  if ( options.backend == BACKEND_MOCK ) {
+    if ( !parse_mock_spec( options.backend_spec )) {
+      fprintf( stderr, "Invalid mock spec '%s'\n", options.backend_spec );
+      exit( 2 );
+    }
+    direct = true;
+  }
+
+  if ( options.backend == BACKEND_REPLAY &&
+       !load_replay_trace( options.backend_spec )) {
+    fprintf( stderr, "%s: not a trace file or a damaged one\n",
+             options.backend_spec );
+    exit( 2 );
+  }
+
+  if ( *options.record_file && !start_trace( options.record_file )) {
+    perror( options.record_file );
+    exit( 2 );
+  }
+
+  /* a trace holds the operations of this process, which must probe the
+   * displays itself to be replayed the same way; displays of a model share
+   * the walk of its reports, so they are handled in a fixed order */
+  if ( options.backend == BACKEND_REPLAY || *options.record_file ) {
+    direct = true;
+    options.jobs = 1;
+  }
+  sort( replay_trace.paths.begin(), replay_trace.paths.end(), node_order );
+  if ( options.backend >= BACKEND_MOCK || *options.record_file )
+    options.discovery_cache = "";
+
+  if ( list_all ) {
+    dump_supported( options.verbose );
+    exit( 0 );
+  }
+
   FileList files;
   
   for ( int param = optind; param < argc; ++param ) {
-    if ( mode != DETECT && number ( argv[ param ] ) ) {
+    if (( mode == GET || mode == SET || mode == SETREL ) &&
+        number ( argv[ param ] ) ) {
       if ( argv[ param ][0] == '+' || argv[ param ][0] == '-' ) {
         mode = SETREL;
         amount = atoi ( argv[ param ] );
@@ -401,178 +5181,152 @@ int main (int argc, char **argv) {
         mode = SET;
         brightness = atoi ( argv[ param ] );
       }
+      options.percent = strchr( argv[ param ], '%' ) != 0;
       continue;
     }
 
     files.push_back( argv[ param ] );
   }
 
-  if ( files.empty() ) {
+  if ( files.empty() && !options.auto_detect ) {
     help( argv[0] );
     exit( 1 );
   }
 
-  if ( mode == SET || mode == SETREL ) {
-    open_mode = O_RDWR;
+  if ( !options.silent )
+    notice();
+
+  list< string > selected;
+  bool selectors = false;
+  for ( FileList::iterator it = files.begin(); it != files.end(); ++it )
+    selectors = selectors || is_selector( *it );
+  if ( selectors ) {
+    if ( !resolve_selectors( files, selected, options ))
+      status = 1;
+    if ( files.empty() && !options.auto_detect )
+      return status;
   }
 
-  if ( !silent )
-    notice();
+  /* let a running daemon do the work, it has the devices probed already */
+  if ( !direct && ( mode == GET || mode == SET || mode == SETREL )) {
+    int fd = daemon_connect( options.socket_path );
+    if ( fd >= 0 ) {
+      status = run_client( fd, mode, mode == SET ? brightness : amount,
+                           files, options );
+      if ( status < 0 )
+        status = 0;
+      else if ( files.empty() )
+        return status;
+    }
+  }
 
-  for ( FileList::iterator it = files.begin(); it != files.end();
-        ++it ) {
-    if (( fd = open( *it, open_mode )) < 0) {
-      perror(*it);
-      continue;
+  load_discovery_cache( options );
+
+  vector< string > discovered;
+  if ( options.auto_detect ) {
+    discovered = discover_displays( mode != DETECT && mode != DUMP,
+                                    options );
+    for ( size_t i = 0; i < discovered.size(); ++i )
+      files.push_back( discovered[ i ].c_str() );
+
+    if ( files.empty() ) {
+      cerr << "No display found" << endl;
+      finish( 1 );
     }
-    
-    /* ioctl() accesses the underlying driver */
-    ioctl(fd, HIDIOCGVERSION, &version);
+  }
+
+  if ( mode == DAEMON )
+    finish( run_daemon( files, options ));
+
+  if ( mode == WATCH )
+    finish( run_watch( files, options ));
+
+  vector< Outcome > outcomes( files.size() );
+  FileList::iterator it = files.begin();
+  for ( size_t i = 0; i < outcomes.size(); ++i, ++it )
+    outcomes[ i ].path = *it;
+
+  if ( mode == RESTORE && !load_state( options.state_file )) {
+    perror( options.state_file );
+    finish( 1 );
+  }
+
+  process_devices( mode, mode == SETREL ? amount : brightness, options,
+                   outcomes );
+  save_discovery_cache( options );
+
+  string state = "# acdcontrol monitor state\n";
+  for ( size_t i = 0; i < outcomes.size(); ++i ) {
+    const Outcome& o = outcomes[ i ];
+
     /* the HIDIOCGVERSION ioctl() returns a packed 32 field (aka integer) */
-    /* so we unpack it and display it */
-    if ( ! silent && first_device )
+    /* so we unpack it and display it; other backends have no version */
+    if ( ! options.silent && first_device && o.opened && o.version ) {
       printf("hiddev driver version is %d.%d.%d\n",
-             version >> 16, (version >> 8) & 0xff, version & 0xff);
-    
-    /* suck out some device information */
-    ioctl(fd, HIDIOCGDEVINFO, &device_info);
-    
-    if ( mode == DETECT ) {
-      if ( is_usb_monitor( device_info, fd ) ) {
-        cout << *it << ": USB Monitor - "
-             << (is_supported( device_info ) ? "SUPPORTED": "UNSUPPORTED")
-             << ".\t";
-        format_device( cout, device_info );
-      }
-      continue;
+             o.version >> 16, (o.version >> 8) & 0xff, o.version & 0xff);
+      first_device=false;
     }
 
-    if ( not (selected_device = is_supported ( device_info )) ){
-      cerr << "Device unsupported:";
-      format_device(cerr, device_info);
-      if ( !force )
-        exit ( 2 );
-    }
-    
-    
-    if (! is_usb_monitor( device_info, fd )) {
-      cerr << *it << ": This device is NOT USB monitor!" << endl;
-      continue;
-    }
-    
-    /* Initialise the internal report structures */
-    if (ioctl(fd, HIDIOCINITREPORT,0) < 0) {
-      cerr << "FATAL: Failed to initialize internal report structures"
-           << endl;
-      exit(1);
-    }
-    
-    usage_ref.report_type = HID_REPORT_TYPE_FEATURE;
-    usage_ref.report_id = BRIGHTNESS_CONTROL;
-    usage_ref.field_index = 0;
-    usage_ref.usage_index = 0;
-    usage_ref.usage_code = USAGE_CODE;
-    usage_ref.value = brightness;
-    //  dump_usage ( usage_ref );
-    
-    rep_info.report_type = HID_REPORT_TYPE_FEATURE;
-    rep_info.report_id = BRIGHTNESS_CONTROL;
-    rep_info.num_fields = 1;
-
-    if ( mode == SET ) {
-      if ( ioctl(fd, HIDIOCSUSAGE, &usage_ref) < 0 ) {
-        perror ("Usage failed!");
-        exit ( 2 );
-      }
-      if ( ioctl(fd, HIDIOCSREPORT, &rep_info) < 0 ) {
-        perror ("Report failed!");
-        exit ( 3 );
-      }
+    fflush( stdout );
+    cerr << o.err;
+    if ( mode == SAVE )
+      state += o.out;
+    else
+      cout << o.out << flush;
+    if ( o.rc > 0 )
+      finish( o.rc );
+  }
+
+  if ( mode == SAVE ) {
+    if ( strcmp( options.state_file, "-" ) == 0 ) {
+      cout << state << flush;
     } else {
-      if ( ioctl(fd, HIDIOCGUSAGE, &usage_ref) < 0 ) {
-        perror ("Usage failed!");
-        exit ( 2 );
-      }
-      if ( ioctl(fd, HIDIOCGREPORT, &rep_info) < 0 ) {
-        perror ("Report failed!");
-        exit ( 3 );
-      }
-      if ( mode == SETREL ) {
-        brightness = usage_ref.value + amount;
-        brightness = max( selected_device->brightness_min, brightness);
-        brightness = min( selected_device->brightness_max, brightness);
-        usage_ref.value = brightness;
-
-        /* set calculated brightness */
-        if ( ioctl(fd, HIDIOCSUSAGE, &usage_ref) < 0 ) {
-          perror ("Usage failed!");
-          exit ( 2 );
-        }
-        if ( ioctl(fd, HIDIOCSREPORT, &rep_info) < 0 ) {
-          perror ("Report failed!");
-          exit ( 3 );
-        }
-        /* read brightness back from device */
-        if ( ioctl(fd, HIDIOCGUSAGE, &usage_ref) < 0 ) {
-          perror ("Usage failed!");
-          exit ( 2 );
-        }
-        if ( ioctl(fd, HIDIOCGREPORT, &rep_info) < 0 ) {
-          perror ("Report failed!");
-          exit ( 3 );
-        }
+      ofstream file( options.state_file );
+      file << state;
+      file.close();
+      if ( !file ) {
+        perror( options.state_file );
+        finish( 1 );
       }
-      if ( !brief )
-        cout << *it << ": BRIGHTNESS=";
-      cout << usage_ref.value << endl;
     }
-
-    close(fd);
-    first_device=false;
   }
+  finish( status );
 }
+#endif
 
 
 
-void init_device_database() {
-  supportedVendors.insert( VendorDesc( SAMSUNG, "Samsung Electronics" ) );
-  supportedVendors.insert( VendorDesc( APPLE, "Apple" ) );
-
-  supportedDevices.insert( DeviceId( APPLE, STUDIO_DISPLAY_15,
-                                     "Apple Studio Display 15\"" ));
-  supportedDevices.insert( DeviceId( APPLE, STUDIO_DISPLAY_17,
-                                     "Apple Studio Display 17\"" ));
-//   supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_20_NEW,
-//                                      "Apple Cinema Display 20\" (new)" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_20_OLD,
-                                     "Apple Cinema Display 20\" (old)" ));
-//   supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_23_NEW,
-//                                      "Apple Cinema Display 23\" (new)" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_23_OLD,
-                                     "Apple Cinema Display 23\" (old)" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_24,
-                                     "Apple Cinema Display 24\"" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_30,
-                                     "Apple Cinema HD Display 30\"" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_27,
-                                     "Apple Cinema HD Display 27\"", 0, 1024 ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_HD_27,
-                                     "Apple Cinema HD Display 27\"" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_LED_24,
-                                     "Apple LED Cinema Display 24\"" ));
-  supportedDevices.insert( DeviceId( APPLE, CINEMA_DISPLAY_HD_27_2013,
-                                     "Apple Cinema HD Display 27\"" ));
-
-  supportedDevices.insert( DeviceId( SAMSUNG, S1,
-                                     "Samsung SyncMaster 757NF" ));
+/** Lists the supported devices
+ * @param models whether to show the model names selectors take
+ */
+void dump_supported ( bool models ) {
+  /* both lists are sorted, entries of the database file win */
+  const DeviceId* builtin = supportedDevices;
+  const DeviceId* file = db_devices;
+  const DeviceId* builtin_end = supportedDevices + DEVICE_COUNT;
+  const DeviceId* file_end = db_devices + db_device_count;
 
-}
+  while ( builtin != builtin_end || file != file_end ) {
+    const DeviceId* it;
+    if ( file == file_end ||
+         ( builtin != builtin_end && device_order( *builtin, *file )))
+      it = builtin++;
+    else {
+      if ( builtin != builtin_end && !device_order( *file, *builtin ))
+        ++builtin;
+      it = file++;
+    }
 
-void dump_supported () {
-  for ( SupportedDevices::iterator it = supportedDevices.begin();
-        it != supportedDevices.end(); ++ it )
+    const char* vendor = vendor_name( it->vendor );
     cout << "Vendor=" << setw( 6 ) << hex << showbase << it->vendor
-         << " (" << supportedVendors[ it->vendor ] << "), "
-         << "Product=" << it->product << " [" 
-         << it->description << "]" << endl;
+         << " (" << ( vendor ? vendor : "unknown" ) << "), "
+         << "Product=" << it->product;
+    if ( it->release )
+      cout << "/" << it->release;
+    cout << " [" 
+         << it->description << "]";
+    if ( models )
+      cout << " model:" << it->name;
+    cout << endl;
+  }
 }
@@ -0,0 +1,24 @@
+#!/bin/sh
+# A GET after a burst of relative changes merged by the daemon answers the
+# brightness written last, not the one cached before the burst.
+
+. $(dirname $0)/functions
+SOCKET=$(mktemp -u /tmp/acdcontrol-test.XXXXXX)
+
+$ACDCONTROL --silent --daemon --socket $SOCKET --backend=mock:brightness=127 \
+  --coalesce 200 --cache-ttl 10000 mock0 > /dev/null &
+daemon=$!
+trap 'kill $daemon; rm -f $SOCKET' EXIT
+while [ ! -S $SOCKET ]; do sleep 0.05; done
+
+client() {
+  $ACDCONTROL --silent --brief --socket $SOCKET mock0 "$@"
+}
+
+replies="$(client +10) $(client +10) $(client +10)"
+[ "$replies" = "137 147 157" ] || fail "SETREL replies: $replies"
+value=$(client)
+[ "$value" = "157" ] || fail "GET after burst: $value"
+value=$(client +1)
+[ "$value" = "158" ] || fail "SETREL after burst: $value"
+exit 0
@@ -0,0 +1,36 @@
+#!/bin/sh
+# A device database whose devices are out of order or whose names are not
+# terminated is refused rather than searched.
+
+. $(dirname $0)/functions
+TMP=$(mktemp -d /tmp/acdcontrol-test.XXXXXX)
+trap 'rm -rf $TMP' EXIT
+
+cat > $TMP/devices.txt <<END
+device 05ac 9232 CINEMA_DISPLAY_30 0 255 - Apple Cinema HD Display 30"
+device 05ac 9236 CINEMA_DISPLAY_LED_24 0 255 - Apple LED Cinema Display 24"
+END
+$ACDCONTROL --silent --device-db $TMP/devices.db \
+  --compile-db $TMP/devices.txt || fail "compiling the database failed"
+
+# header of 16 bytes, no vendors, device records of 128 bytes each
+HEADER=16
+RECORD=128
+refused() {
+  $ACDCONTROL --silent --device-db $1 --list-all 2>&1 >/dev/null |
+    grep -q "not a device database"
+}
+
+refused $TMP/devices.db && fail "intact database refused"
+
+{ head -c $HEADER $TMP/devices.db
+  tail -c $RECORD $TMP/devices.db
+  head -c $(( HEADER + RECORD )) $TMP/devices.db | tail -c $RECORD
+} > $TMP/unsorted.db
+refused $TMP/unsorted.db || fail "unsorted database used"
+
+cp $TMP/devices.db $TMP/unterminated.db
+printf '%032d' 0 | dd of=$TMP/unterminated.db bs=1 seek=$(( HEADER + 8 )) \
+  conv=notrunc 2>/dev/null
+refused $TMP/unterminated.db || fail "database with unterminated name used"
+exit 0
@@ -0,0 +1,14 @@
+#!/bin/sh
+# A display of the database whose report descriptor cannot be read is driven
+# through the brightness report the database assumes, with its range.
+
+. $(dirname $0)/functions
+MOCK=--backend=mock:no-descriptor,model=CINEMA_DISPLAY_27,brightness=1000
+
+value=$($ACDCONTROL --silent --brief $MOCK --auto)
+[ "$value" = "1000" ] || fail "GET: $value"
+value=$($ACDCONTROL --silent --brief $MOCK --auto +20)
+[ "$value" = "1020" ] || fail "SETREL: $value"
+value=$($ACDCONTROL --silent --brief $MOCK --auto +40)
+[ "$value" = "1024" ] || fail "SETREL beyond the range: $value"
+exit 0
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Every probe of --auto has a deadline of its own: displays probed one after
+# another are all found although together they take longer than the timeout,
+# and each display not answering in time is named in a warning.
+
+. $(dirname $0)/functions
+PROBE="--probe-timeout 100 --jobs 1 --auto"
+
+found=$($ACDCONTROL --silent --backend=mock:displays=4,latency=30 $PROBE |
+        wc -l)
+[ $found -eq 4 ] || fail "$found of 4 displays found"
+
+warnings=$($ACDCONTROL --silent --backend=mock:displays=4,latency=150 $PROBE \
+           2>&1 >/dev/null | grep -c "no answer within 100 ms")
+[ $warnings -eq 4 ] || fail "$warnings of 4 hanging displays named"
+exit 0
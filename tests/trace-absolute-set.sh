@@ -0,0 +1,17 @@
+#!/bin/sh
+# Setting an absolute brightness on a built-in model writes the report and
+# nothing else: no priming read before the write and no read back after it.
+
+. $(dirname $0)/functions
+TRACE=$(mktemp /tmp/acdcontrol-test.XXXXXX)
+trap 'rm -f $TRACE' EXIT
+
+$ACDCONTROL --silent --backend=mock --record $TRACE --auto 100 ||
+  fail "SET failed"
+ops=$(trace_ops $TRACE | tr '\n' ' ')
+case "$ops" in
+  *GET_*)                    fail "SET reads the display: $ops" ;;
+  *" SET_USAGE SET_REPORT ") ;;
+  *)                         fail "SET does not write: $ops" ;;
+esac
+exit 0
@@ -0,0 +1,34 @@
+#!/bin/sh
+# An absolute brightness the display has already is not written again when
+# the display is read anyway to prime it, and is written right away when it
+# is not; --force-write writes it in any case.
+
+. $(dirname $0)/functions
+TMP=$(mktemp -d /tmp/acdcontrol-test.XXXXXX)
+trap 'rm -rf $TMP' EXIT
+
+cat > $TMP/devices.txt <<END
+device 05ac 9232 CINEMA_DISPLAY_30 0 255 needs-prime-write Apple Cinema HD Display 30"
+END
+$ACDCONTROL --silent --device-db $TMP/devices.db \
+  --compile-db $TMP/devices.txt || fail "compiling the database failed"
+
+set_ops() {
+  $ACDCONTROL --silent --backend=mock:brightness=127 --record $TMP/trace \
+    "$@" --auto 127 > /dev/null || fail "SET failed"
+  trace_ops $TMP/trace | tr '\n' ' '
+}
+
+case "$(set_ops --device-db $TMP/devices.db)" in
+  *SET_*) fail "primed display is written the brightness it has" ;;
+esac
+case "$(set_ops --device-db $TMP/devices.db --force-write)" in
+  *" GET_REPORT GET_USAGE SET_USAGE SET_REPORT ") ;;
+  *) fail "--force-write does not write" ;;
+esac
+case "$(set_ops)" in
+  *GET_*) fail "display is read before an absolute write" ;;
+  *" SET_USAGE SET_REPORT ") ;;
+  *) fail "display is not written" ;;
+esac
+exit 0
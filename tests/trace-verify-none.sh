@@ -0,0 +1,32 @@
+#!/bin/sh
+# --verify=none writes a relative change without reading it back, even on a
+# model the device database marks readback-required; sync reads it back.
+
+. $(dirname $0)/functions
+TMP=$(mktemp -d /tmp/acdcontrol-test.XXXXXX)
+trap 'rm -rf $TMP' EXIT
+
+cat > $TMP/devices.txt <<END
+device 05ac 9232 CINEMA_DISPLAY_30 0 255 readback-required Apple Cinema HD Display 30"
+END
+$ACDCONTROL --silent --device-db $TMP/devices.db \
+  --compile-db $TMP/devices.txt || fail "compiling the database failed"
+
+for db in "" $TMP/devices.db; do
+  $ACDCONTROL --silent --device-db "$db" --backend=mock --verify=none \
+    --record $TMP/trace --auto +10 > /dev/null || fail "SETREL failed"
+  ops=$(trace_ops $TMP/trace | tr '\n' ' ')
+  case "$ops" in
+    *" SET_REPORT ") ;;
+    *)               fail "--verify=none reads back (${db:-built-in}): $ops" ;;
+  esac
+
+  $ACDCONTROL --silent --device-db "$db" --backend=mock --verify=sync \
+    --record $TMP/trace --auto +10 > /dev/null || fail "SETREL failed"
+  ops=$(trace_ops $TMP/trace | tr '\n' ' ')
+  case "$ops" in
+    *" SET_REPORT GET_REPORT GET_USAGE ") ;;
+    *)               fail "--verify=sync does not read back: $ops" ;;
+  esac
+done
+exit 0